@@ -22,6 +22,7 @@ typedef struct
 } DCC_SetLocoFunction_t;
 
 #define DCC_STOP_LOCO (0x12)
+#define DCC_STOP_ALL (0)	// Address to stop all locomotives
 typedef struct
 {
 	uint8_t Id;
@@ -29,4 +30,11 @@ typedef struct
 	uint8_t Forward;
 } DCC_StopLoco_t;
 
+#define DCC_TRACK_FAULT (0x13)
+typedef struct
+{
+	uint8_t Id;
+	uint8_t Fault;		// Non-zero whilst track is blanked by overcurrent
+} DCC_TrackFault_t;
+
 #endif 
\ No newline at end of file
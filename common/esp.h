@@ -146,6 +146,7 @@ extern void ESP_RxTask(ESP_t *Esp);
 
 extern void ESP_TxReset(ESP_t *Esp);
 extern void ESP_TxTask(ESP_t *Esp);
+extern bool ESP_TxSlipEncode(ESP_t *Esp);
 extern void ESP_TxHandleAcknowledgment(ESP_t *Esp, const uint8_t Ack);
 extern void ESP_TxPacket(ESP_t *Esp, ESP_Packet_t *TxPacket);
 
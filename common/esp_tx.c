@@ -4,9 +4,10 @@
 
 #define ESP_TxDebug(...)
 
-bool ESP_TxEncodeBytes(ESP_t *Esp)
+/* SLIP encode packet into transmit buffer until buffer is full, returns true once the
+   complete packet has been encoded.  Hardware isn't touched, so it can be benchmarked */
+bool ESP_TxSlipEncode(ESP_t *Esp)
 {
-	const uint16_t BufIndex = ESP_HwTxBufferIndex(&Esp->Hw);
 	bool TxComplete = false;
 
 	while (ESP_HwTxBufferSpace(&Esp->Hw) >= 3)
@@ -50,6 +51,14 @@ bool ESP_TxEncodeBytes(ESP_t *Esp)
 		}
 	}
 	
+	return TxComplete;
+}
+
+bool ESP_TxEncodeBytes(ESP_t *Esp)
+{
+	const uint16_t BufIndex = ESP_HwTxBufferIndex(&Esp->Hw);
+	const bool TxComplete = ESP_TxSlipEncode(Esp);
+	
 	/* Check if buffer index has changed */
 	if (ESP_HwTxBufferIndex(&Esp->Hw) != BufIndex)
 	{
@@ -11,30 +11,51 @@
 #include "pio.h"
 #include "debug.h"
 #include "rtime.h"
+#include "evsys.h"
+#include "ac.h"
+
+/* Event channel routing comparator output to TC4 */
+#define AC_EVSYS_CHANNEL	(5)
+
+/* Event channel routing overcurrent comparator output to TCC0 fault input */
+#define AC_EVSYS_FAULT_CHANNEL	(6)
+
+/* Default threshold, VDD * (7 + 1) / 64 */
+#define AC_SCALER_DEFAULT	(7)
+
+/* Acknowledgment is an increase in current of at least 60mA */
+#define AC_ACK_CURRENT		(60)
 
 uint32_t AC_TriggeredCount = 0;
-uint32_t AC_TriggerStart;
-uint32_t AC_TriggerEnd;
+volatile uint16_t AC_PulseWidthMax;
 
-extern volatile Time_t DCC_TimerTime;
+
+/* Scaler for a threshold of at least given current in milliamps, threshold is
+   VDD * (SCALER + 1) / 64 */
+static uint8_t AC_Scaler(uint32_t MilliAmps)
+{
+	uint32_t Scaler = (CS_MV(MilliAmps) * 64 + CS_VDD_MV - 1) / CS_VDD_MV;
+	if (Scaler > 0)
+		Scaler -= 1;
+	return (Scaler > 63) ? 63 : Scaler;
+}
 
 
-void AC_Handler(void)
+/* Pulse width captured on falling edge of comparator output, so there's one interrupt per
+   pulse rather than one per edge */
+void TC4_Handler(void) __attribute__ ((__interrupt__));
+void TC4_Handler(void)
 {
-	uint32_t status = AC->INTFLAG.reg;
-	AC->INTFLAG.reg = status;
-	if (AC->STATUSA.bit.STATE3)
-	{
-		AC_TriggerStart = DCC_TimerTime;
-		PIO_Set(PIN_PB09);
-	}
-	else
+	const uint8_t Status = TC4->COUNT16.INTFLAG.reg;
+	TC4->COUNT16.INTFLAG.reg = Status;
+	if (Status & TC_INTFLAG_MC1)
 	{
-		AC_TriggerEnd = DCC_TimerTime;
-		PIO_Clear(PIN_PB09);
+		/* Reading CC1 also clears the capture flag */
+		const uint16_t Width = TC4->COUNT16.CC[1].reg;
+		if (Width > AC_PulseWidthMax)
+			AC_PulseWidthMax = Width;
+		AC_TriggeredCount += 1;
 	}
-		
-	AC_TriggeredCount += 1;
 }
 
 
@@ -54,16 +75,50 @@ void AC_Init(void)
 	AC->CTRLA.reg = AC_CTRLA_SWRST;			// Reset AC register
 	while (AC->SYNCBUSY.bit.SWRST);
 	
-	// COMPx - Positive Pin, and Negative VDDscale source, Hysteresis Control, High Speed, Interruption Rising
+	// COMPx - Positive Pin, and Negative VDDscale source, Hysteresis Control, Event on comparator output
 	AC->COMPCTRL[3].reg = AC_COMPCTRL_MUXPOS_PIN2 | AC_COMPCTRL_MUXNEG_VSCALE |
 						  AC_COMPCTRL_HYSTEN | AC_COMPCTRL_INTSEL_TOGGLE |
 						  AC_COMPCTRL_SPEED_LOW | AC_COMPCTRL_OUT_OFF | AC_COMPCTRL_FLEN_MAJ5;
-	AC->SCALER[3].reg = AC_SCALER_VALUE(7);
+	AC->SCALER[3].reg = AC_SCALER_VALUE(AC_SCALER_DEFAULT);
+
+	/* Overcurrent comparator on same pin, always enabled and unfiltered so TCC0 sees a short
+	   as quickly as possible */
+	AC->COMPCTRL[2].reg = AC_COMPCTRL_MUXPOS_PIN2 | AC_COMPCTRL_MUXNEG_VSCALE |
+						  AC_COMPCTRL_HYSTEN | AC_COMPCTRL_SPEED_HIGH | AC_COMPCTRL_OUT_OFF |
+						  AC_COMPCTRL_FLEN_OFF | AC_COMPCTRL_ENABLE;
+	AC->SCALER[2].reg = AC_SCALER_VALUE(AC_Scaler(AC_OVERCURRENT));
+	AC->EVCTRL.reg = AC_EVCTRL_COMPEO2 | AC_EVCTRL_COMPEO3;
 	AC->CTRLA.bit.ENABLE = 1;
 	
-	NVIC_SetPriority(AC_IRQn, 3);
-	NVIC_EnableIRQ(AC_IRQn);	
+	/* Enable TC4 Bus clock, and 1MHz GCLK1 so widths are in microseconds */
+	MCLK->APBCMASK.reg |= MCLK_APBCMASK_TC4;
+	CLK_EnablePeripheral(1, TC4_GCLK_ID);
+	
+	/* Period and pulse width capture, counter restarts on rising edge of event and pulse
+	   width is captured in CC1 on falling edge */
+	TC4->COUNT16.CTRLA.reg = TC_CTRLA_SWRST;
+	while (TC4->COUNT16.SYNCBUSY.bit.SWRST);
+	TC4->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV1 | TC_CTRLA_CAPTEN0 | TC_CTRLA_CAPTEN1;
+	TC4->COUNT16.EVCTRL.reg = TC_EVCTRL_TCEI | TC_EVCTRL_EVACT_PPW;
+	
+	NVIC_SetPriority(TC4_IRQn, 3);
+	NVIC_EnableIRQ(TC4_IRQn);
+	
+	TC4->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+	
+	EVSYS_Init();
+	EVSYS_AsyncChannel(AC_EVSYS_CHANNEL, EVSYS_ID_GEN_AC_COMP_3, EVSYS_ID_USER_TC4_EVU);
+	EVSYS_AsyncChannel(AC_EVSYS_FAULT_CHANNEL, EVSYS_ID_GEN_AC_COMP_2, EVSYS_ID_USER_TCC0_EV_0);
 }
 
 
-	
\ No newline at end of file
+/* Raise comparator threshold above default when decoder's idle current, in milliamps, is
+   high enough that it would otherwise look like an acknowledgment */
+void AC_SetAckThreshold(uint16_t Baseline)
+{
+	uint8_t Scaler = AC_Scaler(Baseline + AC_ACK_CURRENT);
+	if (Scaler < AC_SCALER_DEFAULT)
+		Scaler = AC_SCALER_DEFAULT;
+
+	AC->SCALER[3].reg = AC_SCALER_VALUE(Scaler);
+}
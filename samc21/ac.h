@@ -12,30 +12,55 @@
 #include "pio.h"
 #include "rtime.h"
 #include "debug.h"
+#include "cs.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Track current in milliamps that trips overcurrent comparator, blanking TCC0 outputs */
+#define AC_OVERCURRENT	(2500)
+
+/* Shortest pulse that's accepted as a service mode acknowledgment, nominally 6ms +/- 1ms */
+#define AC_ACK_MIN	(5000)
+
+/* Comparator output is routed by event to TC4 which measures the width of each pulse in
+   microseconds, the longest pulse since the trigger was enabled is kept */
 extern uint32_t AC_TriggeredCount;
-extern uint32_t AC_TriggerStart;
-extern uint32_t AC_TriggerEnd;
-extern volatile Time_t DCC_TimerTime;
+extern volatile uint16_t AC_PulseWidthMax;
 
 void AC_Init(void);
+void AC_SetAckThreshold(uint16_t Baseline);
 
 static inline void AC_EnableTrigger(void)
 {
-	AC_TriggerStart = AC_TriggerEnd = DCC_TimerTime;
+	/* Acknowledgment is measured against decoder's idle current */
+	AC_SetAckThreshold(CS_GetCurrent());
+
+	/* Restart counter so a pulse already going on is measured from now */
+	TC4->COUNT16.CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
+	AC_PulseWidthMax = 0;
+	TC4->COUNT16.INTFLAG.reg = TC_INTFLAG_MC1 | TC_INTFLAG_OVF;
+	TC4->COUNT16.INTENSET.reg = TC_INTENSET_MC1;
 	AC->COMPCTRL[3].bit.ENABLE = 1;
-	AC->INTENSET.reg |= AC_INTENSET_COMP3;
 }
 
+/* Returns width of longest pulse in microseconds, including a pulse that's still going on */
 static inline Time_t AC_DisableTrigger(void)
 {
 	if (AC->STATUSA.bit.STATE3)
-		AC_TriggerEnd = DCC_TimerTime;
+	{
+		/* No falling edge yet, so width is time since counter was restarted on rising edge */
+		TC4->COUNT16.CTRLBSET.reg = TC_CTRLBSET_CMD_READSYNC;
+		while (TC4->COUNT16.SYNCBUSY.reg & (TC_SYNCBUSY_CTRLB | TC_SYNCBUSY_COUNT));
+		const uint16_t Width = TC4->COUNT16.COUNT.reg;
+		if (Width > AC_PulseWidthMax)
+			AC_PulseWidthMax = Width;
+	}
 
 	AC->COMPCTRL[3].bit.ENABLE = 0;
-	AC->INTENCLR.reg |= AC_INTENCLR_COMP3;
-	PIO_Clear(PIN_PB09);
-	return Time_Sub(AC_TriggerEnd, AC_TriggerStart);
+	TC4->COUNT16.INTENCLR.reg = TC_INTENCLR_MC1;
+	return AC_PulseWidthMax;
 }
 
 static inline void AC_ResetTriggerCount(void)
@@ -48,5 +73,8 @@ static inline uint32_t AC_TriggerCount(void)
 	return AC_TriggeredCount;
 }
 
+#ifdef __cplusplus
+}
+#endif
 
-#endif /* AC_H_ */
\ No newline at end of file
+#endif /* AC_H_ */
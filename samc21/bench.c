@@ -0,0 +1,289 @@
+/*
+ * bench.c
+ *
+ * Created: 18/10/2026 15:22:08
+ *  Author: jonso
+ */ 
+
+#include <sam.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "os.h"
+#include "mem.h"
+#include "esp.h"
+#include "debug.h"
+#include "bench.h"
+
+#if BENCH_ENABLE
+
+extern void xvprintf(const char *Format, va_list ArgList, void (*PutCharFunc)(char, void *), void *PutCharData);
+
+#if BENCH_HOST
+/* Simulator's MEM_Alloc() is heap backed, pool allocator from mem.c is built under these names */
+extern void *Bench_PoolAlloc(uint16_t Size);
+extern void Bench_PoolFree(const void *Mem);
+#else
+#define Bench_PoolAlloc(Size)	MEM_Alloc(Size)
+#define Bench_PoolFree(Mem)		MEM_Free(Mem)
+#endif
+
+/* Block sizes of pools in mem.c, and blocks allocated then freed by each sample */
+static const uint16_t Bench_PoolSize[] = { 8, 16, 32, 48, 64, 128, 256 };
+#define BENCH_POOL_BLOCKS	(4)
+
+/* Largest ESP payload, percentage of bytes that need escaping in each run */
+#define BENCH_SLIP_PAYLOAD	(127)
+static const uint8_t Bench_SlipDensity[] = { 0, 10, 50, 100 };
+
+static Bench_PrintF_t Bench_PrintF;
+static uint32_t Bench_Overhead;
+
+/* ESP instance that's never attached to a USART, only its buffers are used */
+static ESP_t Bench_Esp;
+static ESP_Packet_t Bench_TxPacket;
+static uint8_t Bench_Payload[BENCH_SLIP_PAYLOAD];
+
+
+#if !BENCH_HOST
+
+const char Bench_TimerUnit[] = "cycles";
+
+/* SysTick counts down at the CPU clock and reloads every millisecond, so a sample must be
+   shorter than that */
+uint32_t Bench_TimerStart(void)
+{
+	return SysTick->VAL;
+}
+
+uint32_t Bench_TimerStop(uint32_t Start)
+{
+	const uint32_t End = SysTick->VAL;
+	return (Start >= End) ? Start - End : Start + SysTick->LOAD + 1 - End;
+}
+
+#endif
+
+
+void Bench_Begin(Bench_Result_t *Result, const char *Kernel, uint16_t Param, uint16_t Ops)
+{
+	Result->Kernel = Kernel;
+	Result->Param = Param;
+	Result->Ops = Ops;
+	Result->Samples = 0;
+	Result->Min = UINT32_MAX;
+	Result->Max = 0;
+	Result->Total = 0;
+}
+
+
+/* Add sample with cost of reading the timer removed */
+void Bench_Sample(Bench_Result_t *Result, uint32_t Time)
+{
+	Time = (Time > Bench_Overhead) ? Time - Bench_Overhead : 0;
+	if (Time < Result->Min)
+		Result->Min = Time;
+	if (Time > Result->Max)
+		Result->Max = Time;
+	Result->Total += Time;
+	Result->Samples += 1;
+}
+
+
+/* Times are per sample, divide by ops for time per operation */
+void Bench_Report(const Bench_Result_t *Result)
+{
+	if (Result->Samples == 0)
+		return;
+
+	Bench_PrintF("{\"kernel\":\"%s\",\"param\":%u,\"ops\":%u,\"samples\":%u,\"unit\":\"%s\",\"min\":%lu,\"mean\":%lu,\"max\":%lu}\n",
+				 Result->Kernel, Result->Param, Result->Ops, Result->Samples, Bench_TimerUnit, (unsigned long)Result->Min,
+				 (unsigned long)(Result->Total / Result->Samples), (unsigned long)Result->Max);
+}
+
+
+void Bench_Init(Bench_PrintF_t PrintF)
+{
+	Bench_PrintF = PrintF;
+
+	/* Cost of reading timer is taken off every sample */
+	Bench_Result_t Result;
+	Bench_Overhead = 0;
+	Bench_Begin(&Result, "timer", 0, 1);
+	for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+		Bench_Sample(&Result, Bench_TimerStop(Bench_TimerStart()));
+	Bench_Overhead = Result.Min;
+
+	Bench_PrintF("{\"kernel\":\"timer\",\"unit\":\"%s\",\"overhead\":%lu}\n", Bench_TimerUnit, (unsigned long)Bench_Overhead);
+}
+
+
+static void Bench_Pools(void)
+{
+	for (uint8_t Pool = 0; Pool < sizeof(Bench_PoolSize) / sizeof(Bench_PoolSize[0]); Pool++)
+	{
+		const uint16_t Size = Bench_PoolSize[Pool];
+		Bench_Result_t Alloc, Free;
+		Bench_Begin(&Alloc, "mem_alloc", Size, BENCH_POOL_BLOCKS);
+		Bench_Begin(&Free, "mem_free", Size, BENCH_POOL_BLOCKS);
+
+		for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+		{
+			void *Block[BENCH_POOL_BLOCKS];
+			uint32_t Start = Bench_TimerStart();
+			for (uint8_t Index = 0; Index < BENCH_POOL_BLOCKS; Index++)
+				Block[Index] = Bench_PoolAlloc(Size);
+			Bench_Sample(&Alloc, Bench_TimerStop(Start));
+
+			Start = Bench_TimerStart();
+			for (uint8_t Index = 0; Index < BENCH_POOL_BLOCKS; Index++)
+				Bench_PoolFree(Block[Index]);
+			Bench_Sample(&Free, Bench_TimerStop(Start));
+		}
+
+		Bench_Report(&Alloc);
+		Bench_Report(&Free);
+	}
+}
+
+
+/* Escaped bytes are spread evenly through payload and alternate between frame and escape.
+   First byte is never a message ID, so on target the received payload is just freed */
+static void Bench_SlipPayload(uint8_t Density)
+{
+	bool Frame = true;
+	for (uint8_t Index = 0; Index < BENCH_SLIP_PAYLOAD; Index++)
+	{
+		if (((Index + 1) * Density / 100) != (Index * Density / 100))
+		{
+			Bench_Payload[Index] = Frame ? ESP_SLIP_FRAME : ESP_SLIP_ESCAPE;
+			Frame = !Frame;
+		}
+		else
+			Bench_Payload[Index] = 0x55;
+	}
+}
+
+
+/* Set up payload packet for encoding, sequence number is what the receiver expects next */
+static void Bench_SlipStart(void)
+{
+	Bench_TxPacket.Type = ESP_PACKET_TYPE_PAYLOAD_STATIC;
+	Bench_TxPacket.Data = Bench_Payload;
+	Bench_TxPacket.Header[0] = (1 << ESP_PKT_CHANNEL_POS) | (Bench_Esp.RxSeq << ESP_PKT_SEQ_POS);
+	Bench_TxPacket.Header[1] = BENCH_SLIP_PAYLOAD << ESP_PKT_PAYLOAD_SIZE_POS;
+
+	Bench_Esp.TxPacket = &Bench_TxPacket;
+	Bench_Esp.TxPacketDataIndex = 0;
+	Bench_Esp.TxPacketDataSize = ESP_PKT_HEADER_SIZE + BENCH_SLIP_PAYLOAD;
+	BufferInit(Bench_Esp.Hw.TxUsartBuffer);
+}
+
+
+static void Bench_Slip(void)
+{
+	ESP_TxInit(&Bench_Esp);
+	ESP_RxInit(&Bench_Esp);
+
+	for (uint8_t Run = 0; Run < sizeof(Bench_SlipDensity); Run++)
+	{
+		const uint8_t Density = Bench_SlipDensity[Run];
+		Bench_SlipPayload(Density);
+
+		Bench_Result_t Encode, Decode;
+		Bench_Begin(&Encode, "slip_encode", Density, BENCH_SLIP_PAYLOAD);
+		Bench_Begin(&Decode, "slip_decode", Density, BENCH_SLIP_PAYLOAD);
+
+		for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+		{
+			/* Whole frame fits in transmit buffer so it's encoded by one call */
+			Bench_SlipStart();
+			uint32_t Start = Bench_TimerStart();
+			const bool Complete = ESP_TxSlipEncode(&Bench_Esp);
+			Bench_Sample(&Encode, Bench_TimerStop(Start));
+			PanicFalse(Complete);
+
+			/* Loop encoded frame back into receive buffer */
+			const uint16_t Amount = BufferAmount(Bench_Esp.Hw.TxUsartBuffer);
+			memcpy(Bench_Esp.Hw.RxUsartBuffer.Buffer, Bench_Esp.Hw.TxUsartBuffer.Buffer, Amount);
+			Bench_Esp.Hw.RxUsartBuffer.Outdex = 0;
+			Bench_Esp.Hw.RxUsartBuffer.Index = Amount;
+
+			Start = Bench_TimerStart();
+			ESP_RxTask(&Bench_Esp);
+			Bench_Sample(&Decode, Bench_TimerStop(Start));
+		}
+
+		Bench_Report(&Encode);
+		Bench_Report(&Decode);
+	}
+
+	Bench_Esp.TxPacket = NULL;
+	ESP_DestroyPacket(Bench_Esp.RxPacket);
+	Bench_Esp.RxPacket = NULL;
+}
+
+
+static void Bench_PutChar(char Char, void *Context)
+{
+	(void)Char;
+	*(uint16_t *)Context += 1;
+}
+
+static uint16_t Bench_Format(const char *Format, ...)
+{
+	uint16_t Count = 0;
+	va_list ArgList;
+	va_start(ArgList, Format);
+	xvprintf(Format, ArgList, Bench_PutChar, &Count);
+	va_end(ArgList);
+	return Count;
+}
+
+
+/* Lines typical of CLI output, param is number of characters output */
+static void Bench_Formatting(void)
+{
+	Bench_Result_t Result;
+	uint16_t Count;
+
+	Count = Bench_Format("%-11s %4u %6u %5u %4u %6lu %9lu\n", "Speed", 64, 40, 12, 30, 123456UL, 0UL);
+	Bench_Begin(&Result, "xvprintf_table", Count, 1);
+	for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+	{
+		const uint32_t Start = Bench_TimerStart();
+		Bench_Format("%-11s %4u %6u %5u %4u %6lu %9lu\n", "Speed", 64, 40, 12, 30, 123456UL, 0UL);
+		Bench_Sample(&Result, Bench_TimerStop(Start));
+	}
+	Bench_Report(&Result);
+
+	Count = Bench_Format("Time %lu.%06lus\n", 4294UL, 967295UL);
+	Bench_Begin(&Result, "xvprintf_time", Count, 1);
+	for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+	{
+		const uint32_t Start = Bench_TimerStart();
+		Bench_Format("Time %lu.%06lus\n", 4294UL, 967295UL);
+		Bench_Sample(&Result, Bench_TimerStop(Start));
+	}
+	Bench_Report(&Result);
+
+	Count = Bench_Format("%08lX %016b %s\n", 0x123ABCUL, 0x550F, "String");
+	Bench_Begin(&Result, "xvprintf_radix", Count, 1);
+	for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+	{
+		const uint32_t Start = Bench_TimerStart();
+		Bench_Format("%08lX %016b %s\n", 0x123ABCUL, 0x550F, "String");
+		Bench_Sample(&Result, Bench_TimerStop(Start));
+	}
+	Bench_Report(&Result);
+}
+
+
+void Bench_Run(void)
+{
+	Bench_Pools();
+	Bench_Slip();
+	Bench_Formatting();
+}
+
+#endif
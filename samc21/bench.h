@@ -0,0 +1,65 @@
+/*
+ * bench.h
+ *
+ * Created: 18/10/2026 15:22:41
+ *  Author: jonso
+ *
+ * Microbenchmarks of hot paths.  The same kernels are built into the firmware, timed with
+ * SysTick in CPU cycles, and into the host benchmark in sim/, timed in nanoseconds.  Each
+ * result is reported as one line of JSON so host and target runs can be compared.
+ */
+
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kernels take RAM for their own ESP instance, so they're only built into the firmware on request */
+#ifndef BENCH_ENABLE
+#define BENCH_ENABLE	0
+#endif
+
+/* Set when building the host benchmark */
+#ifndef BENCH_HOST
+#define BENCH_HOST		0
+#endif
+
+/* Samples taken of each kernel.  Interrupts aren't disabled, so the minimum is the figure to compare */
+#define BENCH_SAMPLES	(256)
+
+typedef void (*Bench_PrintF_t)(const char *Format, ...);
+
+typedef struct
+{
+	const char *Kernel;
+	uint16_t Param;			// Kernel specific, e.g. number of addresses
+	uint16_t Ops;			// Operations timed by each sample
+	uint16_t Samples;
+	uint32_t Min;
+	uint32_t Max;
+	uint64_t Total;
+} Bench_Result_t;
+
+/* Timer for samples, CPU cycles on target or nanoseconds on host */
+extern const char Bench_TimerUnit[];
+uint32_t Bench_TimerStart(void);
+uint32_t Bench_TimerStop(uint32_t Start);
+
+void Bench_Init(Bench_PrintF_t PrintF);
+void Bench_Begin(Bench_Result_t *Result, const char *Kernel, uint16_t Param, uint16_t Ops);
+void Bench_Sample(Bench_Result_t *Result, uint32_t Time);
+void Bench_Report(const Bench_Result_t *Result);
+
+/* Run kernels common to host and target: memory pools, SLIP encode and decode, formatting */
+void Bench_Run(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H_ */
@@ -10,6 +10,8 @@
 #include "buffer.h"
 #include "debug.h"
 #include "dcc.h"
+#include "cs.h"
+#include "bench.h"
 
 typedef struct
 {
@@ -20,48 +22,6 @@ typedef struct
 
 CLI_Buffer_t CLI_Buffer;
 
-typedef struct 
-{
-	uint8_t Loco;
-	uint32_t Functions;
-} CLI_LocoFunctions_t;
-
-CLI_LocoFunctions_t CLI_LocoFunctions[32];
-
-uint32_t CLI_GetLocoFunctions(uint8_t Loco)
-{
-	for (int Index = 0; Index < 32; Index++)
-	{
-		if (CLI_LocoFunctions[Index].Loco == Loco)
-			return CLI_LocoFunctions[Index].Functions;
-	}
-	return 0;
-}
-
-void CLI_SetLocoFunctions(uint8_t Loco, uint32_t Functions)
-{
-	for (int Index = 0; Index < 32; Index++)
-	{		
-		if (CLI_LocoFunctions[Index].Loco == Loco)
-		{
-			CLI_LocoFunctions[Index].Functions = Functions;
-			return;
-		}
-	}
-	
-	for (int Index = 0; Index < 32; Index++)
-	{		
-		if (CLI_LocoFunctions[Index].Loco == 0)
-		{
-			CLI_LocoFunctions[Index].Loco = Loco;			
-			CLI_LocoFunctions[Index].Functions = Functions;
-			return;
-		}
-	}
-	
-}
-
-
 typedef struct 
 {
 	int (*command)(int arvc, const char *argv[]);
@@ -79,6 +39,12 @@ static bool CLI_ArgToInt(const char *Arg, int *Value)
 	return 1;
 }
 
+static bool CLI_ArgToLoco(const char *Arg, int *Value)
+{
+	/* Short addresses 1 - 127, long addresses 128 - 10239 */
+	return CLI_ArgToInt(Arg, Value) && (*Value >= 1) && (*Value <= 10239);
+}
+
 int CLI_CommandCv(int argc, const char *argv[])
 {
 	if (argc == 2)
@@ -109,13 +75,66 @@ int CLI_CommandCv(int argc, const char *argv[])
 }
 
 
+/* Largest number of CVs read by one CB command */
+#define CLI_CV_BATCH_MAX	(64)
+
+int CLI_CommandCvBatch(int argc, const char *argv[])
+{
+	static int16_t Values[CLI_CV_BATCH_MAX];
+	int First, Last;
+	if ((argc != 2) || !CLI_ArgToInt(argv[1], &First) || !CLI_ArgToInt(argv[2], &Last) ||
+		(First < 1) || (Last < First) || (Last > 1024) || (Last - First >= CLI_CV_BATCH_MAX))
+		return -1;
+	
+	DCC_CvReadBatch_t Batch = { NULL, First, Last - First + 1, Values };
+	DCC_CvReadBatch(&Batch, 1 << 15);
+	
+	/* Show each CV as it's read */
+	uint16_t Shown = 0;
+	while (!Batch.Complete || (Shown < Batch.Done))
+	{
+		if (Shown == Batch.Done)
+			OS_SignalWait(1 << 15);
+		for (; Shown < Batch.Done; Shown++)
+		{
+			if (Values[Shown] == DCC_CV_READ_FAILED)
+				Debug("CV %u failed\n", First + Shown);
+			else
+				Debug("CV %u = %u\n", First + Shown, Values[Shown]);
+		}
+	}
+	return 0;
+}
+
+
+int CLI_CommandPom(int argc, const char *argv[])
+{
+	/* Programming on the main is queued, so command doesn't wait for it to be sent */
+	int Loco, CvId, CvValue, Bit;
+	if ((argc < 3) || (argc > 4) || !CLI_ArgToLoco(argv[1], &Loco) ||
+		!CLI_ArgToInt(argv[2], &CvId) || !CLI_ArgToInt(argv[3], &CvValue) ||
+		(CvId < 1) || (CvId > 1024))
+		return -1;
+	
+	if (argc == 4)
+	{
+		if (!CLI_ArgToInt(argv[4], &Bit) || (Bit < 0) || (Bit > 7))
+			return -1;
+		DCC_PomWriteBit(Loco, CvId, Bit, CvValue != 0);
+	}
+	else
+		DCC_PomWrite(Loco, CvId, CvValue);
+	return 0;
+}
+
+
 int CLI_CommandSpeed(int argc, const char *argv[])
 {
 	if (argc != 2)
 		return -1;
 		
 	int Loco, Speed;
-	if (CLI_ArgToInt(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Speed))
+	if (CLI_ArgToLoco(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Speed))
 	{
 		if (Speed < 0)
 			DCC_SetLocomotiveSpeed(Loco, -Speed, 0);
@@ -131,32 +150,64 @@ int CLI_CommandSpeed(int argc, const char *argv[])
 		return -1;
 }
 
+int CLI_CommandSpeedSteps(int argc, const char *argv[])
+{
+	int Loco, Steps;
+	if ((argc == 2) && CLI_ArgToLoco(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Steps))
+	{
+		if ((Steps != DCC_SPEED_STEPS_14) && (Steps != DCC_SPEED_STEPS_28) && (Steps != DCC_SPEED_STEPS_128))
+			return -1;
+		DCC_SetLocomotiveSpeedSteps(Loco, Steps);
+		return 0;
+	}
+	else if ((argc == 1) && CLI_ArgToLoco(argv[1], &Loco))
+	{
+		/* Read CV29 of decoder on programming track */
+		Steps = DCC_LearnLocomotiveSpeedSteps(Loco);
+		if (Steps == 0)
+		{
+			Debug("Loco %u CV29 read failed, speed steps unchanged\n", Loco);
+			return -2;
+		}
+		Debug("Loco %u uses %u speed steps\n", Loco, Steps);
+		return 0;
+	}
+	else
+		return -1;
+}
+
+int CLI_CommandConsist(int argc, const char *argv[])
+{
+	if (argc != 2)
+		return -1;
+	
+	/* Negative consist address adds locomotive reversed, 0 removes it from its consist */
+	int Loco, Consist;
+	if (CLI_ArgToLoco(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Consist) &&
+		(Consist >= -127) && (Consist <= 127))
+	{
+		if (Consist < 0)
+			DCC_SetLocomotiveConsist(Loco, -Consist, 1);
+		else
+			DCC_SetLocomotiveConsist(Loco, Consist, 0);
+		return 0;
+	}
+	else
+		return -1;
+}
+
 int CLI_CommandFunction(int argc, const char *argv[])
 {
 	if (argc != 2)
 		return -1;
 		
 	int Loco, Function;
-	if (CLI_ArgToInt(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Function))
+	if (CLI_ArgToLoco(argv[1], &Loco) && CLI_ArgToInt(argv[2], &Function))
 	{
-		uint32_t FunctionMap = CLI_GetLocoFunctions(Loco);
-		FunctionMap ^= (1UL << Function);
-		CLI_SetLocoFunctions(Loco, FunctionMap);
-		Debug("Local %u functions %08x\n", Loco, FunctionMap);
-
-		if (Function <= 4)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 1) & 0b01111) | ((FunctionMap & 0b00001) << 4), 0); /* F1 - F4 */
-		else if (Function <= 8)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 5) & 0b01111), 5); /* F5 - F8 */
-		else if (Function <= 12)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 9) & 0b01111), 9); /* F9 - F12 */
-		else if (Function <= 20)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 13) & 0b1111111), 13); /* F13 - F20 */
-		else if (Function <= 28)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 21) & 0b1111111), 21); /* F21 - F28 */
-		else if (Function <= 36)
-			DCC_SetLocomotiveFunctions(Loco, ((FunctionMap >> 29) & 0b1111111), 29); /* F29 - F36 */
-
+		/* Function state is kept by DCC scheduler */
+		if ((Function < 0) || (Function > DCC_FUNCTION_MAX))
+			return -1;
+		DCC_ToggleLocomotiveFunction(Loco, Function);
 		return 0;		
 	}	
 	else
@@ -164,12 +215,168 @@ int CLI_CommandFunction(int argc, const char *argv[])
 }
 
 
+int CLI_CommandPools(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+	
+	Debug("Pool        Size Blocks InUse High Allocs Overflows\n");
+	const DCC_PoolStats_t *Stats;
+	for (uint8_t Index = 0; (Stats = DCC_GetPoolStats(Index)) != NULL; Index++)
+		Debug("%-11s %4u %6u %5u %4u %6lu %9lu\n", Stats->Name, Stats->Size, Stats->NumBlocks,
+			  Stats->InUse, Stats->HighWater, Stats->Allocs, Stats->Overflows);
+	return 0;
+}
+
+
+int CLI_CommandStop(int argc, const char *argv[])
+{
+	if (argc == 0)
+	{
+		/* No locomotive given, stop everything */
+		DCC_EmergencyStop();
+		return 0;
+	}
+	else if (argc == 1)
+	{
+		int Loco;
+		if (CLI_ArgToLoco(argv[1], &Loco))
+		{
+			DCC_StopLocomotive(Loco, DCC_DIRECTION_KEEP);
+			return 0;
+		}
+	}
+	
+	return -1;
+}
+
+
+int CLI_CommandUtilisation(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+	
+	uint32_t Latency, LatencyMax;
+	DCC_GetEmergencyStopLatency(&Latency, &LatencyMax);
+	Debug("Track utilisation %u%%\n", DCC_GetUtilisation());
+	Debug("Emergency stop latency %luus, max %luus\n", Latency, LatencyMax);
+	return 0;
+}
+
+
+int CLI_CommandCurrent(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+
+	uint32_t Faults;
+	const bool Fault = DCC_GetTrackFault(&Faults);
+	Debug("Track current %umA, peak %umA, %lu blocks\n", CS_GetCurrent(), CS_GetPeak(), CS_GetBlockCount());
+	Debug("Overcurrent faults %lu, track %s\n", Faults, Fault ? "off" : "on");
+	return 0;
+}
+
+
+static void CLI_ShowLag(const uint32_t *Lag)
+{
+	for (uint8_t Bucket = 0; Bucket < DCC_LAG_BUCKETS; Bucket++)
+		Debug(" %6lu", Lag[Bucket]);
+	Debug("\n");
+}
+
+
+int CLI_CommandStats(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+	
+	const DCC_Stats_t *Stats = DCC_GetStats();
+	const uint64_t Elapsed = Time_Now() - Stats->Start;
+	const uint32_t Packets = Stats->RealPackets + Stats->ServicePackets + Stats->IdlePackets;
+	if ((Elapsed == 0) || (Packets == 0))
+		return 0;
+	
+	Debug("Elapsed %lums\n", (uint32_t)(Elapsed / 1000));
+	Debug("Track real %lu%%, service %lu%%, idle %lu%%\n", (uint32_t)((Stats->RealTime * 100) / Elapsed),
+		  (uint32_t)((Stats->ServiceTime * 100) / Elapsed), (uint32_t)((Stats->IdleTime * 100) / Elapsed));
+	Debug("Packets real %lu, service %lu, idle %lu (%lu%%)\n", Stats->RealPackets, Stats->ServicePackets,
+		  Stats->IdlePackets, (Stats->IdlePackets * 100) / Packets);
+	Debug("Superseded %lu, send ring high %u, overflows %lu, address queue high %u\n",
+		  Stats->Superseded, Stats->SendHighWater, Stats->SendOverflows, Stats->QueueHighWater);
+	Debug("Commands refused %lu\n", Stats->Refused);
+	
+	static const uint16_t LagLimit[DCC_LAG_BUCKETS - 1] = DCC_LAG_LIMITS_MS;
+	Debug("Lag    Queue");
+	for (uint8_t Bucket = 0; Bucket < DCC_LAG_BUCKETS - 1; Bucket++)
+		Debug("  <%3ums", LagLimit[Bucket]);
+	Debug("  longer\n");
+	Debug("All   %5u", Stats->QueueHighWater);
+	CLI_ShowLag(Stats->Lag);
+	
+	const DCC_AddressStats_t *AddressStats;
+	for (uint8_t Index = 0; (AddressStats = DCC_GetAddressStats(Index)) != NULL; Index++)
+	{
+		/* Long addresses are kept with top two bits set */
+		Debug("%5u %5u", AddressStats->Address & 0x3FFF, AddressStats->QueueHighWater);
+		CLI_ShowLag(AddressStats->Lag);
+	}
+	return 0;
+}
+
+
+int CLI_CommandStatsReset(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+	
+	DCC_ResetStats();
+	return 0;
+}
+
+
+int CLI_CommandTime(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+
+	const Time64_t Now = Time_Now();
+	Debug("Time %lu.%06lus\n", (uint32_t)(Now / 1000000), (uint32_t)(Now % 1000000));
+	return 0;
+}
+
+
+#if BENCH_ENABLE
+int CLI_CommandBench(int argc, const char *argv[])
+{
+	if (argc != 0)
+		return -1;
+
+	Bench_Init(Debug_PrintF);
+	Bench_Run();
+	return 0;
+}
+#endif
+
 
 const CLI_Command_t CLI_CommandTable[] = 
 {
 	{ CLI_CommandCv, "CV", "ID/N VALUE/N", "Write CV value"	},
+	{ CLI_CommandCvBatch, "CB", "FIRST/N LAST/N", "Read range of CVs" },
+	{ CLI_CommandPom, "PM", "LOCO/N ID/N VALUE/N [BIT/N]", "Write CV value, or bit, on the main" },
 	{ CLI_CommandSpeed, "SP", "LOCO/N SPEED/N", "Set locomotive speed" },
+	{ CLI_CommandSpeedSteps, "SS", "LOCO/N [STEPS/N]", "Set locomotive speed steps, or read them from CV29" },
+	{ CLI_CommandConsist, "CS", "LOCO/N CONSIST/N", "Add locomotive to consist, reversed if negative, 0 to remove" },
 	{ CLI_CommandFunction,  "FN", "LOCO/N FUNCTION/B", "Toggle function on or off" },
+	{ CLI_CommandStop, "ST", "[LOCO/N]", "Emergency stop locomotive, or all locomotives" },
+	{ CLI_CommandPools, "PL", "", "Show packet pool usage" },
+	{ CLI_CommandUtilisation, "UT", "", "Show track utilisation and emergency stop latency" },
+	{ CLI_CommandCurrent, "CU", "", "Show track current and overcurrent faults" },
+	{ CLI_CommandTime, "TM", "", "Show time since start" },
+	{ CLI_CommandStats, "SC", "", "Show scheduler statistics" },
+	{ CLI_CommandStatsReset, "SR", "", "Reset scheduler statistics" },
+#if BENCH_ENABLE
+	{ CLI_CommandBench, "BM", "", "Run microbenchmarks, results as lines of JSON" },
+#endif
 	{ 0, 0, 0, 0 }
 };
 
@@ -34,6 +34,9 @@ void CLK_Init(void)
 	/* For generic clock generator 1, select the DFLL48 Clock as input to generate 1MHz clock */
 	GCLK->GENCTRL[1].reg = GCLK_GENCTRL_DIV(48) | GCLK_GENCTRL_GENEN | GCLK_GENCTRL_SRC_DPLL96M | GCLK_GENCTRL_OE;
 
+	/* For generic clock generator 2, select the DFLL48 Clock as input to generate 8MHz clock */
+	GCLK->GENCTRL[2].reg = GCLK_GENCTRL_DIV(6) | GCLK_GENCTRL_GENEN | GCLK_GENCTRL_SRC_DPLL96M;
+
 	/* Output 1Mhz clock from GCLK1 on PB15 */
 	//PIO_SetPeripheral(PIN_PB15, PIO_PERIPHERAL_H);
 	//PIO_EnablePeripheral(PIN_PB15);
@@ -0,0 +1,140 @@
+/*
+ * cs.c
+ *
+ * Created: 18/10/2026 11:04:52
+ *  Author: jonso
+ */ 
+
+#include <sam.h>
+#include <stdint.h>
+
+#include "pio.h"
+#include "clk.h"
+#include "debug.h"
+#include "dmac.h"
+#include "cs.h"
+
+/* Current in milliamps for filtered ADC value, filter keeps 4 fractional bits */
+#define CS_MA(Filtered)	((uint16_t)((((uint32_t)(Filtered) * CS_VDD_MV) >> 16) * 1000 / CS_SENSE_UV_PER_MA))
+
+/* Ping-pong buffer, DMAC fills one block whilst the other is processed */
+static uint16_t CS_Samples[2][CS_BLOCK_SAMPLES];
+static DMAC_Descriptor_t CS_DmaDescriptor __attribute((aligned (8)));
+static uint8_t CS_DmaChannel;
+static uint8_t CS_DmaNext;
+
+/* Filter state, 12-bit ADC result with 4 fractional bits */
+static uint16_t CS_Filtered;
+
+volatile uint16_t CS_Current;
+volatile uint16_t CS_Peak;
+volatile uint32_t CS_BlockCount;
+
+
+static void CS_ProcessBlock(const uint16_t *Samples)
+{
+	/* Moving average over block, 64 12-bit samples can't overflow */
+	uint32_t Sum = 0;
+	uint16_t Peak = 0;
+	for (uint8_t Index = 0; Index < CS_BLOCK_SAMPLES; Index++)
+	{
+		const uint16_t Sample = Samples[Index];
+		Sum += Sample;
+		if (Sample > Peak)
+			Peak = Sample;
+	}
+
+	/* Block average scaled to 4 fractional bits, then single pole IIR */
+	const int32_t Average = (Sum << 4) / CS_BLOCK_SAMPLES;
+	if (CS_BlockCount == 0)
+		CS_Filtered = Average;
+	else
+		CS_Filtered += (Average - (int32_t)CS_Filtered) >> CS_FILTER_SHIFT;
+
+	CS_Current = CS_MA(CS_Filtered);
+	CS_Peak = CS_MA(Peak << 4);
+	CS_BlockCount += 1;
+}
+
+
+static void CS_DmaInterruptHandler(void *Context, const uint8_t DmaChannel, const uint16_t IntPending)
+{
+	uint8_t ChannelId = DMAC->CHID.reg;
+	DMAC->CHID.reg = CS_DmaChannel;
+	const uint8_t IntStatus = DMAC->CHINTFLAG.reg;
+	DMAC->CHINTFLAG.reg = IntStatus;
+	DMAC->CHID.reg = ChannelId;
+
+	if (IntStatus & DMAC_CHINTFLAG_TERR)
+		Panic();
+
+	if (IntStatus & DMAC_CHINTFLAG_TCMPL)
+	{
+		/* Block is complete, process it whilst other block is being filled */
+		CS_ProcessBlock(CS_Samples[CS_DmaNext]);
+		CS_DmaNext ^= 1;
+	}
+}
+
+
+void CS_Init(void)
+{
+	/* Enable ADC1 clock, and drive GCLK_ADC1 from 1MHz GCLK1 */
+	MCLK->APBCMASK.reg |= MCLK_APBCMASK_ADC1;
+	CLK_EnablePeripheral(GCLK_PCHCTRL_GEN_GCLK1_Val, ADC1_GCLK_ID);
+
+	/* PB05 is also comparator input, both are analog so pin is shared */
+	PIO_EnableInput(PIN_PB05B_ADC1_AIN7);
+	PIO_DisablePull(PIN_PB05B_ADC1_AIN7);
+	PIO_SetPeripheral(PIN_PB05B_ADC1_AIN7, PIO_PERIPHERAL_B);
+	PIO_EnablePeripheral(PIN_PB05B_ADC1_AIN7);
+
+	ADC1->CTRLA.reg = ADC_CTRLA_SWRST;
+	while (ADC1->SYNCBUSY.bit.SWRST);
+
+	/* Factory calibration */
+	ADC1->CALIB.reg = ADC_CALIB_BIASREFBUF((*(uint32_t *)ADC1_FUSES_BIASREFBUF_ADDR & ADC1_FUSES_BIASREFBUF_Msk) >> ADC1_FUSES_BIASREFBUF_Pos) |
+					  ADC_CALIB_BIASCOMP((*(uint32_t *)ADC1_FUSES_BIASCOMP_ADDR & ADC1_FUSES_BIASCOMP_Msk) >> ADC1_FUSES_BIASCOMP_Pos);
+
+	/* 500kHz ADC clock, 12-bit conversion with 7 clock sample time takes 20 clocks so free
+	   running rate is 25k samples/s */
+	ADC1->CTRLB.reg = ADC_CTRLB_PRESCALER_DIV2;
+	ADC1->REFCTRL.reg = ADC_REFCTRL_REFSEL_INTVCC2;
+	ADC1->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(6);
+	ADC1->INPUTCTRL.reg = ADC_INPUTCTRL_MUXPOS_AIN7 | ADC_INPUTCTRL_MUXNEG_GND;
+	ADC1->CTRLC.reg = ADC_CTRLC_RESSEL_12BIT | ADC_CTRLC_FREERUN;
+	while (ADC1->SYNCBUSY.reg);
+
+	CS_DmaChannel = DMAC_ChannelAllocate(CS_DmaInterruptHandler, NULL, DMAC_NO_CHANNEL);
+	PanicFalse(CS_DmaChannel != DMAC_NO_CHANNEL);
+
+	/* Descriptors link to each other so DMAC runs continuously, destination addresses are
+	   end of each block as destination address is incremented */
+	DMAC_Descriptor_t *DmaDesc = DMAC_ChannelGetBaseDescriptor(CS_DmaChannel);
+	DmaDesc->BTCTRL.reg = DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_VALID;
+	DmaDesc->BTCNT.reg = CS_BLOCK_SAMPLES;
+	DmaDesc->SRCADDR.reg = DMAC_Address(&ADC1->RESULT.reg);
+	DmaDesc->DSTADDR.reg = DMAC_Address(&CS_Samples[0][CS_BLOCK_SAMPLES]);
+	DmaDesc->DESCADDR.reg = DMAC_Address(&CS_DmaDescriptor);
+
+	CS_DmaDescriptor.BTCTRL.reg = DmaDesc->BTCTRL.reg;
+	CS_DmaDescriptor.BTCNT.reg = CS_BLOCK_SAMPLES;
+	CS_DmaDescriptor.SRCADDR.reg = DMAC_Address(&ADC1->RESULT.reg);
+	CS_DmaDescriptor.DSTADDR.reg = DMAC_Address(&CS_Samples[1][CS_BLOCK_SAMPLES]);
+	CS_DmaDescriptor.DESCADDR.reg = DMAC_Address(DmaDesc);
+	CS_DmaNext = 0;
+
+	/* Reset channel, then transfer one result each time a conversion completes.  Lowest
+	   level and allocated after the DCC channels, so track waveform never waits for samples */
+	DMAC->CHID.reg = CS_DmaChannel;
+	DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_TRIGSRC(ADC1_DMAC_ID_RESRDY);
+	DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+
+	/* Start free running conversions */
+	ADC1->CTRLA.reg = ADC_CTRLA_ENABLE;
+	while (ADC1->SYNCBUSY.bit.ENABLE);
+	ADC1->SWTRIG.reg = ADC_SWTRIG_START;
+}
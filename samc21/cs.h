@@ -0,0 +1,65 @@
+/*
+ * cs.h
+ *
+ * Created: 18/10/2026 11:05:19
+ *  Author: jonso
+ *
+ * Track current sensing, ADC1 samples the current sense voltage on PB05 continuously and
+ * DMAC writes the results into a ping-pong buffer.  Each block is filtered when it completes
+ * so the CPU only runs once per block rather than once per sample.
+ */
+
+
+#ifndef CS_H_
+#define CS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ADC reference is VDDANA, same as comparator VDD scaler */
+#define CS_VDD_MV			(3300)
+
+/* Sense voltage per milliamp in microvolts, 1000 for 1R sense resistor */
+#define CS_SENSE_UV_PER_MA	(1000)
+
+/* Samples per block, at 25k samples/s a block completes every 2.56ms */
+#define CS_BLOCK_SAMPLES	(64)
+
+/* IIR filter coefficient is 1/2^CS_FILTER_SHIFT per block, time constant of ~20ms */
+#define CS_FILTER_SHIFT		(3)
+
+/* Sense voltage in millivolts for current in milliamps */
+#define CS_MV(MilliAmps)	(((uint32_t)(MilliAmps) * CS_SENSE_UV_PER_MA) / 1000)
+
+extern volatile uint16_t CS_Current;
+extern volatile uint16_t CS_Peak;
+extern volatile uint32_t CS_BlockCount;
+
+void CS_Init(void);
+
+/* Filtered track current in milliamps */
+static inline uint16_t CS_GetCurrent(void)
+{
+	return CS_Current;
+}
+
+/* Highest single sample in the last block in milliamps, for events too short for the filter */
+static inline uint16_t CS_GetPeak(void)
+{
+	return CS_Peak;
+}
+
+/* Number of blocks processed, stops advancing if sampling stalls */
+static inline uint32_t CS_GetBlockCount(void)
+{
+	return CS_BlockCount;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_H_ */
@@ -19,246 +19,1340 @@
 
 volatile Time_t DCC_TimerTime;
 
+/* Waveform time is only advanced as each half-bit or DMA half is generated, so the engine
+   reads the clock service, which shares its time base */
+static inline Time_t DCC_Now(void)
+{
+	return (Time_t)Time_Now();
+}
+
 static uint8_t	DCC_Mode;
 
 
-DCC_Packet_t *DCC_PacketSendList;
+/* Packets are submitted through a single producer, single consumer ring for each context
+   that can call DCC_SendPacket().  Tasks are co-operative so share one ring, interrupts have
+   a ring for each NVIC priority level as interrupts at the same level can't pre-empt each
+   other.  Only the producer writes Head and only the DCC task writes Tail.  Speed and
+   function commands are submitted as updates rather than packets, they're applied by the
+   DCC task to the state and packets it keeps for each address */
+#define DCC_SEND_RING_SIZE	(16)
+#define DCC_SEND_RINGS		(1 + (1 << __NVIC_PRIO_BITS))
+
+#if (DCC_SEND_RING_SIZE & (DCC_SEND_RING_SIZE - 1)) != 0
+#error "Send ring size must be a power of 2"
+#endif
+
+typedef enum
+{
+	DCC_SEND_PACKET,
+	DCC_SEND_SPEED,				// Value is speed, Param is direction
+	DCC_SEND_FUNCTION,			// Value is function number, Param is DCC_FUNCTION_OFF, ON or TOGGLE
+	DCC_SEND_FUNCTION_GROUP,	// Value is group data, Param is first function in group
+	DCC_SEND_SPEED_STEPS,		// Value is speed step mode
+	DCC_SEND_CONSIST,			// Value is consist address, Param is reversed
+	DCC_SEND_POM,				// Operations mode packet to add to programming queue
+} DCC_SendType_t;
+
+enum
+{
+	DCC_FUNCTION_OFF,
+	DCC_FUNCTION_ON,
+	DCC_FUNCTION_TOGGLE,
+};
+
+typedef struct
+{
+	DCC_Packet_t *Packet;	// Packet to schedule for DCC_SEND_PACKET
+	uint32_t Sequence;		// Submission order, orders requests from different rings
+	uint16_t Loco;
+	uint8_t Type;
+	uint8_t Value;
+	uint8_t Param;
+} DCC_SendRequest_t;
+
+typedef struct
+{
+	DCC_SendRequest_t Entry[DCC_SEND_RING_SIZE];
+	volatile uint8_t Head;
+	volatile uint8_t Tail;
+	uint16_t Overflows;		// Requests dropped from interrupts as ring was full
+	volatile uint32_t Published;	// Requests published to ring, only written by its producer
+} DCC_SendRing_t;
+
+static DCC_SendRing_t DCC_SendRing[DCC_SEND_RINGS];
+
+
+/* Idle packet is reused rather than allocated each time the track would otherwise be idle */
+static DCC_IdlePacket_t DCC_IdlePacket;
+
+
+/* Open addressed hash table of address information, indexed by full 14 bit address.  Addresses
+   with no packets are reclaimed, least recently used first, once their hold-off time has expired.
+   New addresses are refused once DCC_ADDRESS_INFO_MAX are in use */
+#define DCC_ADDRESS_TABLE_SIZE (256)
+
+#if DCC_ADDRESS_INFO_MAX > (DCC_ADDRESS_TABLE_SIZE / 2)
+#error "Address table must be at most half full"
+#endif
+
+static DCC_AddressInfo_t *DCC_AddressTable[DCC_ADDRESS_TABLE_SIZE];
+static uint16_t DCC_AddressInfoCount;
+
+/* Address information is allocated from a fixed array so the limit can always be reached,
+   entries come from the free list or if that's empty from the unused part of the array */
+static DCC_AddressInfo_t DCC_AddressInfoBlocks[DCC_ADDRESS_INFO_MAX];
+static OS_List_t DCC_AddressFreeList;
+static uint16_t DCC_AddressInfoUnused;
+
+/* Addresses with empty packet lists, oldest first */
+static OS_List_t DCC_AddressIdleList;
+
+/* Min-heap of addresses with packets pending, keyed on earliest time the
+   head packet for each address can be sent.  There's one heap per priority
+   lane, each address is in the lane of the packet at the head of its list */
+typedef struct
+{
+	uint16_t Count;
+	DCC_AddressInfo_t *Entry[DCC_ADDRESS_INFO_MAX];
+} DCC_AddressHeap_t;
+
+static DCC_AddressHeap_t DCC_AddressHeap[DCC_PRIORITY_COUNT];
+
+static const uint8_t ResetPacket[] = { 0x00, 0x00, 0x00 };
+
+
+/* Track utilisation is the fraction of track time spent sending packets other than idle
+   packets, measured over a window and smoothed.  Scaled so DCC_UTILISATION_FULL is 100% */
+#define DCC_UTILISATION_FULL	(256)
+#define DCC_UTILISATION_WINDOW	DCC_MS(100)
+
+static uint16_t DCC_Utilisation;
+static uint32_t DCC_BusyTime;
+static Time_t DCC_UtilisationTime;
+
+/* Scheduler statistics, only written by DCC task.  Addresses keep their entry in the address
+   statistics once reclaimed, addresses seen after the table fills are only counted overall */
+#define DCC_ADDRESS_STATS_MAX	(32)
+
+static DCC_Stats_t DCC_Stats;
+static DCC_AddressStats_t DCC_AddressStats[DCC_ADDRESS_STATS_MAX];
+static uint8_t DCC_AddressStatsCount;
+static volatile bool DCC_StatsResetPending;
+
+/* Refresh periods are shortened for moving locomotives below the low threshold and stretched
+   above the high threshold, up to the given multiple of the base period when the track is full */
+#define DCC_UTILISATION_LOW		(DCC_UTILISATION_FULL / 4)
+#define DCC_UTILISATION_HIGH	(DCC_UTILISATION_FULL / 2)
+#define DCC_REFRESH_STRETCH_MOVING		(2)
+#define DCC_REFRESH_STRETCH_BACKGROUND	(8)
+
+/* Number of broadcast emergency stop packets sent back to back on emergency stop */
+#define DCC_ESTOP_REPEAT	(10)
+
+/* Set by DCC_EmergencyStop(), speed packets are purged by DCC task */
+static volatile bool DCC_EStopPending;
+
+/* Track power is retried after an overcurrent fault, the delay doubles on each fault up to
+   the maximum and goes back to the minimum once the track has stayed on long enough */
+#define DCC_FAULT_RETRY_MIN		DCC_MS(100)
+#define DCC_FAULT_RETRY_MAX		DCC_MS(5000)
+#define DCC_FAULT_CLEAR_TIME	DCC_MS(10000)
+
+static bool DCC_TrackFault;
+static uint32_t DCC_TrackFaultCount;
+static Time_t DCC_TrackRetryTime;
+static Time_t DCC_TrackClearTime;
+static Time_t DCC_TrackBackOff = DCC_FAULT_RETRY_MIN;
+
+/* Speed step modes for addresses that don't use DCC_SPEED_STEPS_DEFAULT.  Kept apart from the
+   address information as that's reclaimed whilst address is idle, only used by DCC task */
+#define DCC_SPEED_STEPS_TABLE_SIZE	(128)
+
+typedef struct
+{
+	uint16_t Address;
+	uint8_t Steps;		// 0 if entry is unused
+} DCC_SpeedSteps_t;
+
+static DCC_SpeedSteps_t DCC_SpeedStepsTable[DCC_SPEED_STEPS_TABLE_SIZE];
+
+/* Advanced consist members, speed and direction for members is sent once to the consist
+   address rather than to each member.  Only used by DCC task */
+#define DCC_CONSIST_MEMBERS_MAX	(32)
+
+typedef struct
+{
+	uint16_t Loco;
+	uint8_t Consist;	// 0 if entry is unused
+	bool Reversed;		// Member runs in reverse of consist direction
+} DCC_ConsistMember_t;
+
+static DCC_ConsistMember_t DCC_ConsistMembers[DCC_CONSIST_MEMBERS_MAX];
+
+/* Operations mode programming packets wait in a queue and are scheduled one at a time, so
+   each decoder sees its packets back to back and the packets pace themselves */
+static DCC_Packet_t *DCC_PomQueueHead;
+static DCC_Packet_t *DCC_PomQueueTail;
+static const DCC_Packet_t *DCC_PomPacket;	// Packet taken from queue, NULL once it's released
+
+/* Addresses that have had new packets recently are always refreshed at the base period */
+#define DCC_REFRESH_CHANGE_TIME	DCC_MS(2000)
+
+
+
+static inline void DCC_HeapSet(DCC_AddressHeap_t *Heap, uint16_t Index, DCC_AddressInfo_t *AddressInfo)
+{
+	Heap->Entry[Index] = AddressInfo;
+	AddressInfo->HeapIndex = Index;
+}
+
+static void DCC_HeapUp(DCC_AddressHeap_t *Heap, uint16_t Index)
+{
+	DCC_AddressInfo_t *AddressInfo = Heap->Entry[Index];
+	while (Index > 0)
+	{
+		const uint16_t Parent = (Index - 1) / 2;
+		if (!Time_Lt(AddressInfo->HeapTime, Heap->Entry[Parent]->HeapTime))
+			break;
+		
+		/* Move parent down */
+		DCC_HeapSet(Heap, Index, Heap->Entry[Parent]);
+		Index = Parent;
+	}
+	DCC_HeapSet(Heap, Index, AddressInfo);
+}
+
+static void DCC_HeapDown(DCC_AddressHeap_t *Heap, uint16_t Index)
+{
+	DCC_AddressInfo_t *AddressInfo = Heap->Entry[Index];
+	for (;;)
+	{
+		uint16_t Child = (2 * Index) + 1;
+		if (Child >= Heap->Count)
+			break;
+		
+		/* Pick earlier of the two children */
+		if ((Child + 1 < Heap->Count) &&
+		    Time_Lt(Heap->Entry[Child + 1]->HeapTime, Heap->Entry[Child]->HeapTime))
+			Child += 1;
+		
+		if (!Time_Lt(Heap->Entry[Child]->HeapTime, AddressInfo->HeapTime))
+			break;
+
+		/* Move child up */
+		DCC_HeapSet(Heap, Index, Heap->Entry[Child]);
+		Index = Child;
+	}
+	DCC_HeapSet(Heap, Index, AddressInfo);
+}
+
+static void DCC_HeapRemove(DCC_AddressInfo_t *AddressInfo)
+{
+	DCC_AddressHeap_t *Heap = &DCC_AddressHeap[AddressInfo->HeapPriority];
+	const uint16_t Index = AddressInfo->HeapIndex;
+	AddressInfo->HeapIndex = DCC_HEAP_NONE;
+	
+	/* Fill hole with last entry and restore heap order */
+	Heap->Count -= 1;
+	if (Index < Heap->Count)
+	{
+		DCC_AddressInfo_t *Last = Heap->Entry[Heap->Count];
+		DCC_HeapSet(Heap, Index, Last);
+		DCC_HeapUp(Heap, Index);
+		DCC_HeapDown(Heap, Last->HeapIndex);
+	}
+}
+
+
+/* Update position of address in heap, must be called whenever hold-off time or head of list changes */
+static void DCC_HeapUpdate(DCC_AddressInfo_t *AddressInfo)
+{
+	if ((AddressInfo->List == NULL) || AddressInfo->Active)
+	{
+		/* Nothing to send for this address or packet already being sent, so remove it from heap */
+		if (AddressInfo->HeapIndex != DCC_HEAP_NONE)
+			DCC_HeapRemove(AddressInfo);
+		return;
+	}
+	
+	AddressInfo->HeapTime = Time_Lt(AddressInfo->HoldOffTime, AddressInfo->List->Time) ? AddressInfo->List->Time : AddressInfo->HoldOffTime;
+	
+	/* Move to another lane if priority of head of list has changed */
+	const uint8_t Priority = AddressInfo->List->Priority;
+	if ((AddressInfo->HeapIndex != DCC_HEAP_NONE) && (AddressInfo->HeapPriority != Priority))
+		DCC_HeapRemove(AddressInfo);
+	
+	DCC_AddressHeap_t *Heap = &DCC_AddressHeap[Priority];
+	if (AddressInfo->HeapIndex == DCC_HEAP_NONE)
+	{
+		/* Add to end of heap */
+		PanicFalse(Heap->Count < DCC_ADDRESS_INFO_MAX);
+		AddressInfo->HeapPriority = Priority;
+		DCC_HeapSet(Heap, Heap->Count, AddressInfo);
+		Heap->Count += 1;
+		DCC_HeapUp(Heap, AddressInfo->HeapIndex);
+	}
+	else
+	{
+		DCC_HeapUp(Heap, AddressInfo->HeapIndex);
+		DCC_HeapDown(Heap, AddressInfo->HeapIndex);
+	}
+}
+
+
+static inline uint16_t DCC_AddressHash(uint16_t Address)
+{
+	/* Fibonacci hash, top bits of product are best mixed */
+	return (uint16_t)(Address * 40503U) >> 8;
+}
+
+
+static void DCC_FreeAddressInfo(DCC_AddressInfo_t *AddressInfo)
+{
+	PanicFalse(AddressInfo->List == NULL);
+	PanicFalse(AddressInfo->HeapIndex == DCC_HEAP_NONE);
+	
+	/* Find slot holding this address */
+	uint16_t Index = DCC_AddressHash(AddressInfo->Address);
+	while (DCC_AddressTable[Index] != AddressInfo)
+		Index = (Index + 1) % DCC_ADDRESS_TABLE_SIZE;
+	DCC_AddressTable[Index] = NULL;
+	
+	/* Shift back any following entries that can no longer be reached past the empty slot */
+	uint16_t Next = Index;
+	for (;;)
+	{
+		Next = (Next + 1) % DCC_ADDRESS_TABLE_SIZE;
+		DCC_AddressInfo_t *Entry = DCC_AddressTable[Next];
+		if (Entry == NULL)
+			break;
+		
+		/* Distance from home slot of entry to its current slot and to the empty slot */
+		const uint16_t Home = DCC_AddressHash(Entry->Address);
+		const uint16_t EntryDistance = (Next + DCC_ADDRESS_TABLE_SIZE - Home) % DCC_ADDRESS_TABLE_SIZE;
+		const uint16_t EmptyDistance = (Index + DCC_ADDRESS_TABLE_SIZE - Home) % DCC_ADDRESS_TABLE_SIZE;
+		if (EmptyDistance < EntryDistance)
+		{
+			DCC_AddressTable[Index] = Entry;
+			DCC_AddressTable[Next] = NULL;
+			Index = Next;
+		}
+	}
+
+	//Debug("Free AI %p for %u", AddressInfo, AddressInfo->Address);
+	OS_ListRemove(&AddressInfo->Node);
+	OS_ListAddHead(&DCC_AddressFreeList, &AddressInfo->Node);
+	DCC_AddressInfoCount -= 1;
+}
+
+
+/* Free idle addresses whose hold-off time has expired, oldest first */
+static void DCC_ReclaimAddressInfo(void)
+{
+	DCC_AddressInfo_t *AddressInfo;
+	const Time_t Now = DCC_Now();
+	while ((AddressInfo = (DCC_AddressInfo_t *)OS_ListHead(&DCC_AddressIdleList)) != NULL)
+	{
+		if (Time_Gt(AddressInfo->HoldOffTime, Now))
+			break;
+		DCC_FreeAddressInfo(AddressInfo);
+	}
+}
+
+
+/* Update address after its packet list has changed */
+static void DCC_UpdateAddressInfo(DCC_AddressInfo_t *AddressInfo)
+{
+	DCC_HeapUpdate(AddressInfo);
+	
+	if ((AddressInfo->List == NULL) && (AddressInfo->Active == NULL))
+	{
+		/* Move to end of idle list, ready to be reclaimed.  Idle packet is sent whenever there's
+		   nothing else to send, so its address is never reclaimed */
+		if (!AddressInfo->Idle && (AddressInfo->Address != DCC_ADDRESS_IDLE))
+		{
+			OS_ListAddTail(&DCC_AddressIdleList, &AddressInfo->Node);
+			AddressInfo->Idle = true;
+		}
+	}
+	else if (AddressInfo->Idle)
+	{
+		OS_ListRemove(&AddressInfo->Node);
+		AddressInfo->Idle = false;
+	}
+}
+
+
+DCC_AddressInfo_t *DCC_AllocAddressInfo(uint16_t Address)
+{
+	/* Find existing Address structure, or first free slot */
+	uint16_t Index = DCC_AddressHash(Address);
+	DCC_AddressInfo_t *AddressInfo;
+	while ((AddressInfo = DCC_AddressTable[Index]) != NULL)
+	{
+		if (AddressInfo->Address == Address)
+			return AddressInfo;
+		Index = (Index + 1) % DCC_ADDRESS_TABLE_SIZE;
+	}
+	
+	/* If at limit attempt to reclaim idle addresses, addresses still being refreshed are never
+	   dropped so new address is refused if none are idle.  Table may be shuffled so search again */
+	if (DCC_AddressInfoCount >= DCC_ADDRESS_INFO_MAX)
+	{
+		DCC_ReclaimAddressInfo();
+		if (DCC_AddressInfoCount >= DCC_ADDRESS_INFO_MAX)
+			return NULL;
+		
+		Index = DCC_AddressHash(Address);
+		while (DCC_AddressTable[Index] != NULL)
+			Index = (Index + 1) % DCC_ADDRESS_TABLE_SIZE;
+	}
+	
+	/* No matching structure found, allocate one.  Count is below the limit so there's always one free */
+	AddressInfo = (DCC_AddressInfo_t *)OS_ListRemoveHead(&DCC_AddressFreeList);
+	if (AddressInfo == NULL)
+		AddressInfo = &DCC_AddressInfoBlocks[DCC_AddressInfoUnused++];
+	AddressInfo->Idle = false;
+	AddressInfo->Address = Address;
+	AddressInfo->HeapIndex = DCC_HEAP_NONE;
+	AddressInfo->StatsIndex = DCC_STATS_NONE;
+	AddressInfo->HoldOffTime = AddressInfo->ChangeTime = DCC_Now();
+	AddressInfo->List = NULL;
+	AddressInfo->Active = NULL;
+	AddressInfo->SpeedPacket = NULL;
+	AddressInfo->FunctionPacket = NULL;
+	AddressInfo->FunctionChanged = 0;
+	memset(AddressInfo->FunctionState, 0, sizeof(AddressInfo->FunctionState));
+	DCC_AddressTable[Index] = AddressInfo;
+	DCC_AddressInfoCount += 1;
+	//Debug("Alloc AI %p for %u", AddressInfo, Address);
+	return AddressInfo;
+}
+
+
+/* Fold time spent sending packets into smoothed utilisation once per window */
+static void DCC_UtilisationUpdate(void)
+{
+	const int32_t Elapsed = Time_Sub(DCC_Now(), DCC_UtilisationTime);
+	if (Elapsed < DCC_UTILISATION_WINDOW)
+		return;
+	
+	uint32_t Sample = (DCC_BusyTime * DCC_UTILISATION_FULL) / (uint32_t)Elapsed;
+	if (Sample > DCC_UTILISATION_FULL)
+		Sample = DCC_UTILISATION_FULL;
+	DCC_Utilisation = ((DCC_Utilisation * 7) + Sample) / 8;
+	
+	DCC_BusyTime = 0;
+	DCC_UtilisationTime = DCC_Now();
+}
+
+
+Time_t DCC_RefreshPeriod(const DCC_Packet_t *Packet, Time_t Base, DCC_RefreshClass_t Class)
+{
+	/* Recently changed addresses keep the base period so changes are repeated promptly */
+	const DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
+	if (AddressInfo && Time_Lt(DCC_Now(), Time_Add(AddressInfo->ChangeTime, DCC_REFRESH_CHANGE_TIME)))
+		return Base;
+	
+	if (DCC_Utilisation < DCC_UTILISATION_LOW)
+	{
+		/* Track is quiet, so refresh moving locomotives more often */
+		return (Class == DCC_REFRESH_MOVING) ? (Base / 2) : Base;
+	}
+	else if (DCC_Utilisation > DCC_UTILISATION_HIGH)
+	{
+		/* Track is busy, stretch period in proportion to utilisation above the threshold */
+		const uint32_t Stretch = (Class == DCC_REFRESH_MOVING) ? DCC_REFRESH_STRETCH_MOVING : DCC_REFRESH_STRETCH_BACKGROUND;
+		return Base + ((Base * (Stretch - 1) * (DCC_Utilisation - DCC_UTILISATION_HIGH)) /
+		               (DCC_UTILISATION_FULL - DCC_UTILISATION_HIGH));
+	}
+	else
+		return Base;
+}
+
+
+uint8_t DCC_GetUtilisation(void)
+{
+	return (DCC_Utilisation * 100) / DCC_UTILISATION_FULL;
+}
+
+
+/* Outputs are blanked by TCC0 as soon as overcurrent comparator trips, this only decides
+   when to try powering the track again */
+static void DCC_TrackFaultUpdate(void)
+{
+	const Time_t Now = DCC_Now();
+	if (!DCC_TrackFault)
+	{
+		if (TCC0->STATUS.reg & TCC_STATUS_FAULT0)
+		{
+			DCC_TrackFault = true;
+			DCC_TrackFaultCount += 1;
+			DCC_TrackRetryTime = Time_Add(Now, DCC_TrackBackOff);
+			Debug("Track overcurrent, retry in %lums\n", DCC_TrackBackOff / 1000);
+			CALLBACK_DCC_TrackFault(true);
+		}
+		else if (Time_Ge(Now, DCC_TrackClearTime))
+			DCC_TrackBackOff = DCC_FAULT_RETRY_MIN;
+	}
+	else if (Time_Ge(Now, DCC_TrackRetryTime))
+	{
+		/* Fault state is only released if comparator output has gone low, either way next
+		   fault waits longer */
+		TCC0->STATUS.reg = TCC_STATUS_FAULT0;
+		DCC_TrackBackOff *= 2;
+		if (DCC_TrackBackOff > DCC_FAULT_RETRY_MAX)
+			DCC_TrackBackOff = DCC_FAULT_RETRY_MAX;
+
+		if (TCC0->STATUS.reg & TCC_STATUS_FAULT0)
+			DCC_TrackRetryTime = Time_Add(Now, DCC_TrackBackOff);
+		else
+		{
+			DCC_TrackFault = false;
+			DCC_TrackClearTime = Time_Add(Now, DCC_FAULT_CLEAR_TIME);
+			Debug("Track power restored\n");
+			CALLBACK_DCC_TrackFault(false);
+		}
+	}
+}
+
+
+bool DCC_GetTrackFault(uint32_t *Count)
+{
+	*Count = DCC_TrackFaultCount;
+	return DCC_TrackFault;
+}
+
+
+/* Statistics entry for address, NULL if table is full */
+static DCC_AddressStats_t *DCC_StatsAddress(DCC_AddressInfo_t *AddressInfo)
+{
+	if (AddressInfo->StatsIndex == DCC_STATS_NONE)
+	{
+		uint8_t Index;
+		for (Index = 0; Index < DCC_AddressStatsCount; Index++)
+			if (DCC_AddressStats[Index].Address == AddressInfo->Address)
+				break;
+		
+		if (Index == DCC_AddressStatsCount)
+		{
+			if (Index == DCC_ADDRESS_STATS_MAX)
+				Index = DCC_STATS_UNTRACKED;
+			else
+			{
+				memset(&DCC_AddressStats[Index], 0, sizeof(DCC_AddressStats_t));
+				DCC_AddressStats[Index].Address = AddressInfo->Address;
+				DCC_AddressStatsCount += 1;
+			}
+		}
+		AddressInfo->StatsIndex = Index;
+	}
+	
+	return (AddressInfo->StatsIndex == DCC_STATS_UNTRACKED) ? NULL : &DCC_AddressStats[AddressInfo->StatsIndex];
+}
+
+
+/* Count packet that has just been sent */
+static void DCC_StatsPacketSent(DCC_Packet_t *Packet)
+{
+	static const uint16_t LagLimit[DCC_LAG_BUCKETS - 1] = DCC_LAG_LIMITS_MS;
+	
+	if (Packet->Address == DCC_ADDRESS_IDLE)
+	{
+		DCC_Stats.IdleTime += Packet->Duration;
+		DCC_Stats.IdlePackets += 1;
+		return;
+	}
+	
+	if (DCC_Mode == DCC_MODE_SERVICE)
+	{
+		DCC_Stats.ServiceTime += Packet->Duration;
+		DCC_Stats.ServicePackets += 1;
+	}
+	else
+	{
+		DCC_Stats.RealTime += Packet->Duration;
+		DCC_Stats.RealPackets += 1;
+	}
+	
+	const int32_t Lag = Time_Sub(Packet->StartTime, Packet->Time);
+	uint8_t Bucket = 0;
+	while ((Bucket < DCC_LAG_BUCKETS - 1) && (Lag >= DCC_MS((int32_t)LagLimit[Bucket])))
+		Bucket++;
+	
+	DCC_Stats.Lag[Bucket] += 1;
+	DCC_AddressStats_t *Stats = DCC_StatsAddress(Packet->AddressInfo);
+	if (Stats)
+		Stats->Lag[Bucket] += 1;
+}
+
+
+/* Track most packets queued for address, called after a packet is added to its list */
+static void DCC_StatsQueueDepth(DCC_AddressInfo_t *AddressInfo)
+{
+	if (AddressInfo->Address == DCC_ADDRESS_IDLE)
+		return;
+	
+	uint8_t Depth = 0;
+	for (const DCC_Packet_t *Packet = AddressInfo->List; Packet; Packet = Packet->Next)
+		Depth++;
+	
+	if (Depth > DCC_Stats.QueueHighWater)
+		DCC_Stats.QueueHighWater = Depth;
+	
+	DCC_AddressStats_t *Stats = DCC_StatsAddress(AddressInfo);
+	if (Stats && (Depth > Stats->QueueHighWater))
+		Stats->QueueHighWater = Depth;
+}
+
+
+static void DCC_StatsReset(void)
+{
+	memset(&DCC_Stats, 0, sizeof(DCC_Stats));
+	DCC_Stats.Start = Time_Now();
+	
+	/* Addresses have to look up their entry again */
+	DCC_AddressStatsCount = 0;
+	for (uint16_t Index = 0; Index < DCC_ADDRESS_TABLE_SIZE; Index++)
+		if (DCC_AddressTable[Index])
+			DCC_AddressTable[Index]->StatsIndex = DCC_STATS_NONE;
+}
+
+
+const DCC_Stats_t *DCC_GetStats(void)
+{
+	uint32_t Overflows = 0;
+	for (uint8_t Index = 0; Index < DCC_SEND_RINGS; Index++)
+		Overflows += DCC_SendRing[Index].Overflows;
+	DCC_Stats.SendOverflows = Overflows;
+	return &DCC_Stats;
+}
+
+
+const DCC_AddressStats_t *DCC_GetAddressStats(uint8_t Index)
+{
+	return (Index < DCC_AddressStatsCount) ? &DCC_AddressStats[Index] : NULL;
+}
+
+
+/* Statistics are cleared by DCC task, as it's the only writer */
+void DCC_ResetStats(void)
+{
+	DCC_StatsResetPending = true;
+	OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+}
+
+
+/* Get next packet to be transmitted.  The highest priority lane with a packet that can be
+   sent now is served first, otherwise the packet that can be sent soonest is chosen */
+DCC_Packet_t *DCC_NextPacket(Time_t &TxTime)
+{
+	DCC_AddressInfo_t *NextAddressInfo = NULL;
+	const Time_t Now = DCC_Now();
+	for (uint8_t Priority = 0; Priority < DCC_PRIORITY_COUNT; Priority++)
+	{
+		const DCC_AddressHeap_t *Heap = &DCC_AddressHeap[Priority];
+		if (Heap->Count == 0)
+			continue;
+		
+		/* Address at top of heap has the earliest packet in this lane */
+		DCC_AddressInfo_t *AddressInfo = Heap->Entry[0];
+		if (Time_Le(AddressInfo->HeapTime, Now))
+		{
+			NextAddressInfo = AddressInfo;
+			break;
+		}
+		
+		if ((NextAddressInfo == NULL) || Time_Lt(AddressInfo->HeapTime, NextAddressInfo->HeapTime))
+			NextAddressInfo = AddressInfo;
+	}
+
+	if (NextAddressInfo == NULL)
+		return NULL;
+
+	TxTime = NextAddressInfo->HeapTime;
+	return NextAddressInfo->List;
+}
+
+
+/* Insert packet into address list in priority order, then chronological order */
+static void DCC_ListInsert(DCC_AddressInfo_t *AddressInfo, DCC_Packet_t *Packet)
+{
+	DCC_Packet_t **ListPacketRef, *ListPacket;
+	for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL; ListPacketRef = &ListPacket->Next)
+	{
+		/* Exit loop if packet is lower priority or after new packet */
+		if ((ListPacket->Priority > Packet->Priority) ||
+		    ((ListPacket->Priority == Packet->Priority) && Time_Gt(ListPacket->Time, Packet->Time)))
+			break;
+	}
+	
+	/* Insert packet into the list */
+	Packet->Next = *ListPacketRef;
+	*ListPacketRef = Packet;
+}
+
+
+static bool DCC_InsertPacket(DCC_Packet_t *Packet)
+{
+	DCC_AddressInfo_t *AddressInfo = DCC_AllocAddressInfo(Packet->Address);
+	if (AddressInfo == NULL)
+	{
+		Debug("No space for address %u\n", Packet->Address);
+		DCC_Stats.Refused += 1;
+		return false;
+	}
+	
+	/* Packets that haven't been scheduled before are new state for the address */
+	if (Packet->AddressInfo == NULL)
+		AddressInfo->ChangeTime = DCC_Now();
+	Packet->AddressInfo = AddressInfo;
+	
+	/* Remove any packets that are the same */
+	DCC_Packet_t **ListPacketRef, *ListPacket;
+	for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL;)
+	{
+		if (Packet->IsSame(ListPacket))
+		{
+			//Debug("Cancel %p\n", ListPacket);
+			*ListPacketRef = ListPacket->Next;
+			ListPacket->Release();
+			DCC_Stats.Superseded += 1;
+		}
+		else
+			ListPacketRef = &ListPacket->Next;
+	}
+	
+	/* Packet being sent can't be removed yet, so stop it being scheduled again once it completes */
+	if (AddressInfo->Active && Packet->IsSame(AddressInfo->Active))
+	{
+		AddressInfo->Active->Cancelled = true;
+		DCC_Stats.Superseded += 1;
+	}
+	
+	DCC_ListInsert(AddressInfo, Packet);
+	DCC_StatsQueueDepth(AddressInfo);
+	
+	/* Head of list may have changed, so update heap */
+	DCC_UpdateAddressInfo(AddressInfo);
+	return true;
+}
+
+
+static bool DCC_SchedulePacket(DCC_Packet_t *Packet)
+{
+	PanicNull(Packet);
+	PanicFalse(Packet->State == DCC_Packet_t::CREATED);
+	
+	/* Ask packet when it want to be sent */
+	Time_t Time = DCC_Now();
+	if (!Packet->Cancelled && Packet->Schedule(Time))
+	{
+		/* Packet want to be sent, store time and update state */
+		Packet->Time = Time;
+		Packet->State = DCC_Packet_t::SCHEDULED;		
+		
+		/* Insert packet into queue in priority and chronological order */
+		if (DCC_InsertPacket(Packet))
+			return true;
+	}
+
+	/* Packet no longer wants to be sent, or there's no space for its address */
+	//if (Packet->Address != 0xFF)
+	//	Debug("Free %p\n", Packet);	
+		
+	/* Inform client that packet has finished */
+	if (Packet->Signal)
+		OS_SignalSend(Packet->TaskId, Packet->Signal);
+					
+	/* Free packet memory */
+	Packet->Release();
+	return false;
+}
+
+
+static void DCC_ReSchedulePacket(DCC_Packet_t *Packet)
+{
+	PanicFalse(Packet->State == DCC_Packet_t::COMPLETE);
+	Packet->State = DCC_Packet_t::CREATED;
+	
+	DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
+	PanicNull(AddressInfo);
+	PanicFalse(AddressInfo->Active == Packet);
+	//if (Packet->Address != 0xFF)
+	//	Debug("Resched %p\n", Packet);
+	
+	/* Address can be scheduled again, hold-off time was set when packet was sent */
+	AddressInfo->Active = NULL;
+	
+	/* Idle packets only fill time the track would otherwise be unused */
+	if (Packet->Address != DCC_ADDRESS_IDLE)
+		DCC_BusyTime += Packet->Duration;
+	DCC_StatsPacketSent(Packet);
+	
+	/* Re-schedule the packet, address is updated on insertion otherwise update it here
+	   as hold-off time has changed */
+	if (!DCC_SchedulePacket(Packet))
+		DCC_UpdateAddressInfo(AddressInfo);
+}
+
+
+/* Discard speed packets for all addresses so refreshes don't restart locomotives after
+   an emergency stop, packets being sent are cancelled and freed once they're returned */
+static void DCC_PurgeSpeedPackets(void)
+{
+	for (uint16_t Index = 0; Index < DCC_ADDRESS_TABLE_SIZE; Index++)
+	{
+		DCC_AddressInfo_t *AddressInfo = DCC_AddressTable[Index];
+		if (AddressInfo == NULL)
+			continue;
+		
+		DCC_Packet_t **ListPacketRef, *ListPacket;
+		for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL;)
+		{
+			if (ListPacket->EmergencyStop())
+			{
+				*ListPacketRef = ListPacket->Next;
+				ListPacket->Release();
+			}
+			else
+				ListPacketRef = &ListPacket->Next;
+		}
+		
+		if (AddressInfo->Active && AddressInfo->Active->EmergencyStop())
+			AddressInfo->Active->Cancelled = true;
+		
+		DCC_UpdateAddressInfo(AddressInfo);
+	}
+}
+
+
+/* Take packet from head of its address list and pass to DCC Tx state machine */
+static void DCC_TxPrefetch(DCC_Packet_t *Packet, Time_t Time)
+{
+	DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
+	PanicFalse(AddressInfo->List == Packet);
+	AddressInfo->List = Packet->Next;
+	AddressInfo->Active = Packet;
+	DCC_UpdateAddressInfo(AddressInfo);
+	
+	DCC_TxSchedule(Packet, Time);
+}
+
+
+/* Return scheduled packet to its address list if DCC Tx state machine hasn't started it */
+static void DCC_TxCancelPrefetch(void)
+{
+	DCC_Packet_t *Packet = DCC_TxUnschedule();
+	if (Packet)
+	{
+		DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
+		AddressInfo->Active = NULL;
+		
+		/* Packet may have been replaced since it was prefetched, if so scheduling it frees it */
+		if (Packet->Cancelled)
+		{
+			Packet->State = DCC_Packet_t::CREATED;
+			DCC_SchedulePacket(Packet);
+		}
+		else
+			DCC_ListInsert(AddressInfo, Packet);
+		DCC_UpdateAddressInfo(AddressInfo);
+	}
+}
+
+
+/* Take oldest submitted request from the send rings, returns false if all are empty */
+static bool DCC_SendRingTake(DCC_SendRequest_t *Request)
+{
+	DCC_SendRing_t *OldestRing = NULL;
+	const DCC_SendRequest_t *Oldest = NULL;
+	for (uint8_t Index = 0; Index < DCC_SEND_RINGS; Index++)
+	{
+		DCC_SendRing_t *Ring = &DCC_SendRing[Index];
+		if (Ring->Tail == Ring->Head)
+			continue;
+		
+		const uint8_t Depth = Ring->Head - Ring->Tail;
+		if (Depth > DCC_Stats.SendHighWater)
+			DCC_Stats.SendHighWater = Depth;
+		
+		/* Requests within a ring are in order, so only head of each ring need be compared */
+		const DCC_SendRequest_t *Entry = &Ring->Entry[Ring->Tail % DCC_SEND_RING_SIZE];
+		if ((Oldest == NULL) || ((int32_t)(Entry->Sequence - Oldest->Sequence) < 0))
+		{
+			OldestRing = Ring;
+			Oldest = Entry;
+		}
+	}
+	
+	if (OldestRing == NULL)
+		return false;
+	
+	/* Entry must be read before slot is handed back to producer */
+	*Request = *Oldest;
+	__DMB();
+	OldestRing->Tail += 1;
+	return true;
+}
+
+
+static DCC_AddressInfo_t *DCC_FindAddressInfo(uint16_t Address)
+{
+	uint16_t Index = DCC_AddressHash(Address);
+	DCC_AddressInfo_t *AddressInfo;
+	while ((AddressInfo = DCC_AddressTable[Index]) != NULL)
+	{
+		if (AddressInfo->Address == Address)
+			return AddressInfo;
+		Index = (Index + 1) % DCC_ADDRESS_TABLE_SIZE;
+	}
+	return NULL;
+}
+
+
+/* Take packet out of its address list */
+static void DCC_ListRemove(DCC_AddressInfo_t *AddressInfo, DCC_Packet_t *Packet)
+{
+	DCC_Packet_t **ListPacketRef = &AddressInfo->List;
+	while (*ListPacketRef != Packet)
+		ListPacketRef = &(*ListPacketRef)->Next;
+	*ListPacketRef = Packet->Next;
+}
 
-DCC_Packet_t *volatile DCC_TxPacket;
-DCC_Packet_t *volatile DCC_ScheduledPacket;
-Time_t DCC_ScheduledPacketTime;
 
+/* Take packet out of its address list and schedule it again, e.g. after its data has changed */
+static void DCC_ListReSchedule(DCC_AddressInfo_t *AddressInfo, DCC_Packet_t *Packet)
+{
+	DCC_ListRemove(AddressInfo, Packet);
+	Packet->State = DCC_Packet_t::CREATED;
+	DCC_SchedulePacket(Packet);
+}
 
-DCC_AddressInfo_t *DCC_AddressInfoList;
 
-static const uint8_t ResetPacket[] = { 0x00, 0x00, 0x00 };
+/* Stop refreshing speed for address, packet being sent is freed once it completes */
+static void DCC_CancelSpeed(uint16_t Address)
+{
+	DCC_AddressInfo_t *AddressInfo = DCC_FindAddressInfo(Address);
+	DCC_SpeedPacket_t *Packet = AddressInfo ? AddressInfo->SpeedPacket : NULL;
+	if (Packet == NULL)
+		return;
+	
+	if (AddressInfo->Active == Packet)
+		Packet->Cancelled = true;
+	else
+	{
+		DCC_ListRemove(AddressInfo, Packet);
+		Packet->Release();
+		DCC_UpdateAddressInfo(AddressInfo);
+	}
+}
+
+
+/* Schedule next operations mode packet once previous one has finished */
+static void DCC_PomSchedule(void)
+{
+	while ((DCC_PomPacket == NULL) && DCC_PomQueueHead)
+	{
+		DCC_Packet_t *Packet = DCC_PomQueueHead;
+		DCC_PomQueueHead = Packet->Next;
+		Packet->Next = NULL;
+		
+		DCC_PomPacket = Packet;
+		DCC_SchedulePacket(Packet);
+	}
+}
 
 
+void DCC_PomComplete(const DCC_Packet_t *Packet)
+{
+	if (Packet == DCC_PomPacket)
+		DCC_PomPacket = NULL;
+}
 
 
-DCC_AddressInfo_t *DCC_AllocAddressInfo(uint8_t Address)
+/* Get consist entry for locomotive, NULL if it isn't in a consist */
+static DCC_ConsistMember_t *DCC_FindConsistMember(uint16_t Loco)
 {
-	/* Find existing Address structure */
-	DCC_AddressInfo_t *AddressInfo = DCC_AddressInfoList;
-	while (AddressInfo)
+	for (uint8_t Index = 0; Index < DCC_CONSIST_MEMBERS_MAX; Index++)
 	{
-		if (AddressInfo->Address == Address)
-			return AddressInfo;
-		AddressInfo = AddressInfo->Next;
+		DCC_ConsistMember_t *Member = &DCC_ConsistMembers[Index];
+		if (Member->Consist && (Member->Loco == Loco))
+			return Member;
+	}
+	return NULL;
+}
+
+
+/* Get speed step mode for address */
+static uint8_t DCC_GetSpeedSteps(uint16_t Address)
+{
+	for (uint8_t Index = 0; Index < DCC_SPEED_STEPS_TABLE_SIZE; Index++)
+	{
+		const DCC_SpeedSteps_t *Entry = &DCC_SpeedStepsTable[Index];
+		if (Entry->Steps && (Entry->Address == Address))
+			return Entry->Steps;
 	}
+	return DCC_SPEED_STEPS_DEFAULT;
+}
+
+
+/* Speed packet data has been rewritten, send it straight away */
+static void DCC_SpeedChanged(DCC_AddressInfo_t *AddressInfo, DCC_SpeedPacket_t *Packet)
+{
+	AddressInfo->ChangeTime = DCC_Now();
 	
-	/* No matching structure found, allocate one */
-	AddressInfo = MEM_Create(DCC_AddressInfo_t);
-	PanicNull(AddressInfo);
-	AddressInfo->Next = DCC_AddressInfoList;
-	AddressInfo->Address = Address;
-	AddressInfo->HoldOffTime = DCC_TimerTime;
-	AddressInfo->List = NULL;
-	DCC_AddressInfoList = AddressInfo;
-	//Debug("Alloc AI %p for %u", AddressInfo, Address);
-	return AddressInfo;
+	/* Packet being sent will be re-scheduled with its new data once it completes */
+	if (AddressInfo->Active != Packet)
+		DCC_ListReSchedule(AddressInfo, Packet);
 }
 
 
-/* Get next packet to be transmitted */
-DCC_Packet_t *DCC_NextPacket(Time_t &TxTime)
+/* Apply speed command, rewriting existing speed packet for the address if there is one */
+static void DCC_UpdateSpeed(const DCC_SendRequest_t *Request)
 {
-	DCC_Packet_t *TxPacket = NULL;
-		
-	DCC_AddressInfo_t *AddressInfo = DCC_AddressInfoList;
-	//Debug("NP time %u\n", TxTime);
-	while (AddressInfo)
+	/* Speed for consist member is sent to consist address.  Member decoders reverse consist
+	   direction themselves, so a reversed member's direction is the opposite of consist's */
+	uint16_t Loco = Request->Loco;
+	uint8_t Forward = Request->Param;
+	const DCC_ConsistMember_t *Member = DCC_FindConsistMember(Loco);
+	if (Member)
 	{
-		//Debug("  %u, time %u, hold off %u\n", AddressInfo->Address, AddressInfo->List ? AddressInfo->List->Time : 0, AddressInfo->List ? AddressInfo->HoldOffTime : 0);
-		
-		/* If we have already found a packet, see if this packet can be Tx'ed earlier */
-		if (TxPacket)
+		Loco = Member->Consist;
+		if (Member->Reversed && (Forward != DCC_DIRECTION_KEEP))
+			Forward = !Forward;
+	}
+	
+	DCC_AddressInfo_t *AddressInfo = DCC_AllocAddressInfo(DCC_Packet_t::LocoAddress(Loco));
+	if (AddressInfo == NULL)
+	{
+		Debug("No space for loco %u\n", Loco);
+		DCC_Stats.Refused += 1;
+		return;
+	}
+	
+	DCC_SpeedPacket_t *Packet = AddressInfo->SpeedPacket;
+	if (Forward == DCC_DIRECTION_KEEP)
+		Forward = Packet ? Packet->GetForward() : 1;
+	if (Packet == NULL)
+	{
+		/* No speed packet for address, so create one */
+		Packet = new DCC_SpeedPacket_t(AddressInfo, DCC_GetSpeedSteps(AddressInfo->Address));
+		if (Packet == NULL)
 		{
-			if (Time_Lt(AddressInfo->HoldOffTime, TxTime))
-			{
-				if (AddressInfo->List && Time_Lt(AddressInfo->List->Time, TxTime))
-				{				
-					TxPacket = AddressInfo->List;
-					TxTime =  Time_Lt(AddressInfo->HoldOffTime, AddressInfo->List->Time) ? AddressInfo->List->Time : AddressInfo->HoldOffTime;
-				}
-			}
+			Debug("No speed packet for loco %u\n", Loco);
+			DCC_Stats.Refused += 1;
+			DCC_UpdateAddressInfo(AddressInfo);
+			return;
 		}
+		
+		Packet->Update(Request->Value, Forward);
+		AddressInfo->ChangeTime = DCC_Now();
+		if (DCC_SchedulePacket(Packet))
+			AddressInfo->SpeedPacket = Packet;
 		else
+			DCC_UpdateAddressInfo(AddressInfo);
+		return;
+	}
+	
+	Packet->Update(Request->Value, Forward);
+	DCC_SpeedChanged(AddressInfo, Packet);
+}
+
+
+/* Add locomotive to consist, or remove it if consist address is 0, and program its CV19 */
+static void DCC_UpdateConsist(const DCC_SendRequest_t *Request)
+{
+	const uint16_t Loco = Request->Loco;
+	const uint8_t Consist = Request->Value;
+	
+	DCC_ConsistMember_t *Member = DCC_FindConsistMember(Loco);
+	const uint8_t OldConsist = Member ? Member->Consist : 0;
+	if (Consist)
+	{
+		if (Member == NULL)
 		{
-			if (AddressInfo->List)
+			for (Member = DCC_ConsistMembers; Member < &DCC_ConsistMembers[DCC_CONSIST_MEMBERS_MAX]; Member++)
+				if (Member->Consist == 0)
+					break;
+			if (Member == &DCC_ConsistMembers[DCC_CONSIST_MEMBERS_MAX])
 			{
-				TxPacket = AddressInfo->List;
-				TxTime = Time_Lt(AddressInfo->HoldOffTime, AddressInfo->List->Time) ? AddressInfo->List->Time : AddressInfo->HoldOffTime;
-			}						
+				Debug("No space for consist member %u\n", Loco);
+				DCC_Stats.Refused += 1;
+				return;
+			}
 		}
+		Member->Loco = Loco;
+		Member->Consist = Consist;
+		Member->Reversed = Request->Param;
 		
-		AddressInfo = AddressInfo->Next;
+		/* Decoder now takes its speed from consist address */
+		DCC_CancelSpeed(DCC_Packet_t::LocoAddress(Loco));
 	}
+	else if (Member)
+		Member->Consist = 0;
 	
-	//Debug("  time %u, addr %u\n", TxTime, TxPacket ? TxPacket->Address : 0);
-
-	return TxPacket;
+	/* Stop refreshing consist that no longer has any members */
+	if (OldConsist && (OldConsist != Consist))
+	{
+		uint8_t Index;
+		for (Index = 0; Index < DCC_CONSIST_MEMBERS_MAX; Index++)
+			if (DCC_ConsistMembers[Index].Consist == OldConsist)
+				break;
+		if (Index == DCC_CONSIST_MEMBERS_MAX)
+			DCC_CancelSpeed(OldConsist);
+	}
+	
+	DCC_Packet_t *Packet = new DCC_ConsistControlPacket_t(Loco, Consist, Request->Param);
+	if (Packet == NULL)
+	{
+		Debug("No consist packet for loco %u\n", Loco);
+		DCC_Stats.Refused += 1;
+		return;
+	}
+	DCC_SchedulePacket(Packet);
 }
 
 
-static void DCC_InsertPacket(DCC_Packet_t *Packet)
+/* Set speed step mode for address, rewriting its speed packet if it has one */
+static void DCC_UpdateSpeedSteps(const DCC_SendRequest_t *Request)
 {
-	DCC_AddressInfo_t *AddressInfo = DCC_AllocAddressInfo(Packet->Address);
-	Packet->AddressInfo = AddressInfo;
+	const uint16_t Address = DCC_Packet_t::LocoAddress(Request->Loco);
 	
-	/* Remove any packets that are the same */
-	DCC_Packet_t **ListPacketRef, *ListPacket;
-	for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL;)
+	/* Only addresses that don't use the default mode are kept in table */
+	DCC_SpeedSteps_t *Free = NULL;
+	uint8_t Index;
+	for (Index = 0; Index < DCC_SPEED_STEPS_TABLE_SIZE; Index++)
 	{
-		if (Packet->IsSame(ListPacket))
+		DCC_SpeedSteps_t *Entry = &DCC_SpeedStepsTable[Index];
+		if (Entry->Steps && (Entry->Address == Address))
 		{
-			//Debug("Cancel %p\n", ListPacket);
-			*ListPacketRef = ListPacket->Next;
-			delete ListPacket;
+			Free = Entry;
+			break;
 		}
-		else
-			ListPacketRef = &ListPacket->Next;
+		else if (!Entry->Steps && !Free)
+			Free = Entry;
 	}
 	
-	/* Insert packet into time ordered list */
-	for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL; ListPacketRef = &ListPacket->Next)
+	if (Request->Value == DCC_SPEED_STEPS_DEFAULT)
 	{
-		/* Exit loop if packet is after new packet */
-		if (Time_Gt(ListPacket->Time, Packet->Time))
-			break;
+		if (Index < DCC_SPEED_STEPS_TABLE_SIZE)
+			Free->Steps = 0;
+	}
+	else if (Free)
+	{
+		Free->Address = Address;
+		Free->Steps = Request->Value;
+	}
+	else
+	{
+		Debug("No space for speed steps of loco %u\n", Request->Loco);
+		DCC_Stats.Refused += 1;
+		return;
 	}
 	
-	/* Insert packet into the list */
-	Packet->Next = *ListPacketRef;
-	*ListPacketRef = Packet;
+	DCC_AddressInfo_t *AddressInfo = DCC_FindAddressInfo(Address);
+	DCC_SpeedPacket_t *Packet = AddressInfo ? AddressInfo->SpeedPacket : NULL;
+	if (Packet && (Packet->GetSteps() != Request->Value))
+	{
+		Packet->SetSteps(Request->Value);
+		DCC_SpeedChanged(AddressInfo, Packet);
+	}
 }
 
 
-static bool DCC_SchedulePacket(DCC_Packet_t *Packet)
+/* Get function group and mask for function number, returns DCC_FUNCTION_GROUPS if invalid */
+static uint8_t DCC_FunctionGroup(uint8_t Function, uint8_t *Mask)
 {
-	PanicNull(Packet);
-	PanicFalse(Packet->State == DCC_Packet_t::CREATED);
-	
-	/* Ask packet when it want to be sent */
-	Time_t Time = DCC_TimerTime;
-	if (Packet->Schedule(Time))
+	if (Function == 0)
 	{
-		/* Packet want to be sent, store time and update state */
-		Packet->Time = Time;
-		Packet->State = DCC_Packet_t::SCHEDULED;		
-		
-		/* Insert packet into queue in chronological order */
-		DCC_InsertPacket(Packet);
-		return true;
+		/* FL is bit 4 of first group */
+		*Mask = 0x10;
+		return 0;
 	}
-	else
+	else if (Function <= 12)
 	{
-		/* Packet no longer wants to be sent */
-		//if (Packet->Address != 0xFF)
-		//	Debug("Free %p\n", Packet);	
-		
-		/* Inform client that packet has finished */
-		if (Packet->Signal)
-			OS_SignalSend(Packet->TaskId, Packet->Signal);
-					
-		/* Free packet memory */
-		delete(Packet);
-		return false;
-	}	
+		*Mask = 1 << ((Function - 1) % 4);
+		return (Function - 1) / 4;
+	}
+	else if (Function <= DCC_FUNCTION_MAX)
+	{
+		*Mask = 1 << ((Function - 13) % 8);
+		return 3 + ((Function - 13) / 8);
+	}
+	else
+		return DCC_FUNCTION_GROUPS;
 }
 
 
-static bool DCC_ReSchedulePacket(DCC_Packet_t *Packet)
+/* Apply function command to function state kept for the address, the address's function
+   packet sends the changed group straight away and is created if there isn't one */
+static void DCC_UpdateFunctions(const DCC_SendRequest_t *Request)
 {
-	PanicFalse(Packet->State == DCC_Packet_t::COMPLETE);
-	Packet->State = DCC_Packet_t::CREATED;
+	uint8_t Group, Mask;
+	if (Request->Type == DCC_SEND_FUNCTION)
+		Group = DCC_FunctionGroup(Request->Value, &Mask);
+	else
+	{
+		Group = DCC_FunctionGroup(Request->Param, &Mask);
+		Mask = (Group == 0) ? 0x1F : (Group < 3) ? 0x0F : 0xFF;
+	}
+	if (Group >= DCC_FUNCTION_GROUPS)
+	{
+		Debug("Invalid function for loco %u\n", Request->Loco);
+		return;
+	}
 	
-	DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
-	PanicNull(AddressInfo);
+	DCC_AddressInfo_t *AddressInfo = DCC_AllocAddressInfo(DCC_Packet_t::LocoAddress(Request->Loco));
+	if (AddressInfo == NULL)
+	{
+		Debug("No space for loco %u\n", Request->Loco);
+		DCC_Stats.Refused += 1;
+		return;
+	}
 	
-	/* Find packet in the list and remove it */
-	DCC_Packet_t **ListPacketRef, *ListPacket;
-	for (ListPacketRef = &AddressInfo->List; (ListPacket = *ListPacketRef) != NULL; ListPacketRef = &ListPacket->Next)
+	uint8_t *State = &AddressInfo->FunctionState[Group];
+	if (Request->Type == DCC_SEND_FUNCTION_GROUP)
+		*State = Request->Value & Mask;
+	else if (Request->Param == DCC_FUNCTION_TOGGLE)
+		*State ^= Mask;
+	else if (Request->Param == DCC_FUNCTION_ON)
+		*State |= Mask;
+	else
+		*State &= ~Mask;
+	AddressInfo->FunctionChanged |= 1U << Group;
+	AddressInfo->ChangeTime = DCC_Now();
+	
+	/* In 14 step mode FL is also sent in speed packet */
+	DCC_SpeedPacket_t *SpeedPacket = AddressInfo->SpeedPacket;
+	if ((Group == 0) && SpeedPacket && (SpeedPacket->GetSteps() == DCC_SPEED_STEPS_14))
+	{
+		SpeedPacket->SetSteps(DCC_SPEED_STEPS_14);
+		DCC_SpeedChanged(AddressInfo, SpeedPacket);
+	}
+	
+	DCC_FunctionPacket_t *Packet = AddressInfo->FunctionPacket;
+	if (Packet == NULL)
 	{
-		if (ListPacket == Packet)
+		/* Change is sent with the rest of the function state once there's a packet for the address */
+		Packet = new DCC_FunctionPacket_t(AddressInfo);
+		if (Packet == NULL)
 		{
-			*ListPacketRef = ListPacket->Next;
-			break;
+			Debug("No function packet for loco %u\n", Request->Loco);
+			DCC_Stats.Refused += 1;
+			DCC_UpdateAddressInfo(AddressInfo);
 		}
+		else if (DCC_SchedulePacket(Packet))
+			AddressInfo->FunctionPacket = Packet;
+	}
+	else if ((AddressInfo->Active != Packet) && (Packet->Priority == DCC_PRIORITY_REFRESH))
+	{
+		/* Packet is waiting to refresh, bring it forward so change is sent now.  Otherwise
+		   it's already due or being sent, and picks up the change when next scheduled */
+		DCC_ListReSchedule(AddressInfo, Packet);
 	}
-	
-	/* We must have found the packet, if not something has gone seriously wrong */
-	PanicNull(ListPacket);
-	//if (ListPacket->Address != 0xFF)
-	//	Debug("Resched %p\n", ListPacket);
-	
-	/* Re-schedule the packet */
-	return DCC_SchedulePacket(ListPacket);
 }
 
 
-
-
-
-
-
-
-
-void DCC_Task(void *Instance)
+void DCC_Task(void *)
 {	
 	for (;;)
 	{
-		/* Check if active packet is now complete */
-		if (DCC_TxIsComplete())
+		if (DCC_StatsResetPending)
 		{
-			/* Attempt to schedule the packet again */
-			DCC_ReSchedulePacket(DCC_TxPacket);
-			
-			/* Clear scheduled packet to prevent DCC Tx state machine from re-starting immediately */
-			DCC_ScheduledPacket = NULL;
-			
-			/* Move DCC Tx state machine back to idle */
-			DCC_TxIdle();
+			DCC_StatsResetPending = false;
+			DCC_StatsReset();
 		}
 		
-		/* If no packet active, get next packet to be scheduled */
-		OS_InterruptDisable();
-		if (DCC_TxIsIdle())
+		/* Re-schedule packets that have been sent */
+		DCC_Packet_t *Packet = DCC_TxCompleted();
+		while (Packet)
 		{
-			DCC_ScheduledPacket = NULL;
-			OS_InterruptEnable();
-			
-			/* Move packets from send list to scheduled list */
-			while (DCC_PacketSendList)
+			DCC_Packet_t *NextPacket = Packet->Next;
+			DCC_ReSchedulePacket(Packet);
+			Packet = NextPacket;
+		}
+		
+		/* Free addresses that no longer have packets to send */
+		DCC_ReclaimAddressInfo();
+		
+		DCC_UtilisationUpdate();
+		DCC_TrackFaultUpdate();
+
+		/* Schedule submitted packets and apply updates in the order they arrived */
+		DCC_SendRequest_t Request;
+		while (DCC_SendRingTake(&Request))
+		{
+			switch (Request.Type)
 			{
-				/* Remove from send list */
-				DCC_Packet_t *Packet = DCC_PacketSendList;
-				DCC_PacketSendList = Packet->Next;
-			
-				/* Schedule packet */
-				DCC_SchedulePacket(Packet);			
+				case DCC_SEND_PACKET:
+					DCC_SchedulePacket(Request.Packet);
+					break;
+				
+				case DCC_SEND_SPEED:
+					DCC_UpdateSpeed(&Request);
+					break;
+				
+				case DCC_SEND_FUNCTION:
+				case DCC_SEND_FUNCTION_GROUP:
+					DCC_UpdateFunctions(&Request);
+					break;
+				
+				case DCC_SEND_SPEED_STEPS:
+					DCC_UpdateSpeedSteps(&Request);
+					break;
+				
+				case DCC_SEND_CONSIST:
+					DCC_UpdateConsist(&Request);
+					break;
+				
+				case DCC_SEND_POM:
+					Request.Packet->Next = NULL;
+					if (DCC_PomQueueHead)
+						DCC_PomQueueTail->Next = Request.Packet;
+					else
+						DCC_PomQueueHead = Request.Packet;
+					DCC_PomQueueTail = Request.Packet;
+					break;
 			}
+		}
+		
+		DCC_PomSchedule();
+
+		/* Emergency stop is already being sent, make sure nothing restarts locomotives */
+		if (DCC_EStopPending)
+		{
+			DCC_EStopPending = false;
+			DCC_PurgeSpeedPackets();
+		}
+		
+		/* If a packet is waiting to be sent put it back, so the choice of next packet
+		   takes account of any new packets and packets that have just completed */
+		DCC_TxCancelPrefetch();
 
-			/* Update schedule packet */
-			DCC_ScheduledPacket = DCC_NextPacket(DCC_ScheduledPacketTime);
+		/* Get next packet to send */
+		Time_t PacketTime;
+		Packet = DCC_NextPacket(PacketTime);
 
-			/* In Normal mode send idle packets */
-			if (DCC_Mode == DCC_MODE_NORMAL)
-			{
-				/* If no packet scheduled or packet is more than 20ms away, send an idle packet */
-				if ((DCC_ScheduledPacket == NULL) ||
-				    (Time_Gt(DCC_ScheduledPacketTime, Time_Add(DCC_TimerTime, 20000))))
-				{	
-					DCC_Packet_t *Packet = new DCC_IdlePacket_t();
-					DCC_SchedulePacket(Packet);
-					
-					/* Update scheduled packet */
-					DCC_ScheduledPacket = DCC_NextPacket(DCC_ScheduledPacketTime);
-				}
+		/* In Normal mode send idle packets */
+		if (DCC_Mode == DCC_MODE_NORMAL)
+		{
+			/* If no packet scheduled or packet is more than 20ms away, send an idle packet */
+			if ((Packet == NULL) ||
+			    (Time_Gt(PacketTime, Time_Add(DCC_Now(), 20000))))
+			{	
+				if (DCC_IdlePacket.State == DCC_Packet_t::CREATED)
+					DCC_SchedulePacket(&DCC_IdlePacket);
+				
+				/* Update next packet */
+				Packet = DCC_NextPacket(PacketTime);
 			}
-		}			
-		else
-			OS_InterruptEnable();
+		}
+		
+		/* Prefetch next packet, compiling it for transmission, so DCC Tx state machine
+		   can send it straight after the active packet */
+		if (Packet)
+			DCC_TxPrefetch(Packet, PacketTime);
 			
 		OS_SignalWait(OS_SIGNAL_USER);		
 	}
@@ -283,6 +1377,9 @@ void DCC_Init(DCC_Mode_t Mode)
 	static uint32_t DCC_TaskStack[512];
 	
 	DCC_Mode = Mode;
+	
+	OS_ListInit(&DCC_AddressIdleList);
+	OS_ListInit(&DCC_AddressFreeList);
 		
 	/* Initialize GPIO (PORT) */
 	PIO_EnableOutput(PIN_PA08);
@@ -303,13 +1400,30 @@ void DCC_Init(DCC_Mode_t Mode)
 	TCC0->CTRLA.reg &=~(TCC_CTRLA_ENABLE);
 	TCC0->WAVE.reg |= TCC_WAVE_WAVEGEN_NFRQ;
 
+	/* TCC0 and clock service run from the same source, so waveform time started from the
+	   clock stays on the same time base */
+	DCC_TimerTime = Time_Now();
+	DCC_Stats.Start = Time_Now();
+	DCC_TxInit();
+
+#if DCC_TX_DMA
+	/* Pattern buffer is written by DMA on each overflow */
+	DCC_TxDmaInit();
+#else
 	/* Enable update interrupt */
 	TCC0->INTENSET.reg |= TCC_INTENSET_OVF;
 	NVIC_SetPriority(TCC0_IRQn, 0);
 	NVIC_EnableIRQ(TCC0_IRQn);
+#endif
 
-	/* Set TCC0 timer interrupt for every 58uS */
-	TCC0->PERBUF.reg = TCC0->PER.reg = 58;
+	/* Overcurrent comparator event is a non-recoverable fault which forces both outputs low
+	   without software involvement, pattern generator is overridden until fault is released */
+	TCC0->EVCTRL.reg = TCC_EVCTRL_TCEI0 | TCC_EVCTRL_EVACT0_FAULT;
+	TCC0->DRVCTRL.reg = TCC_DRVCTRL_NRE0 | TCC_DRVCTRL_NRE1;
+
+	/* Start with TCC0 timer overflow every 58uS, period is then set for each half-bit.  Counter
+	   runs from zero to PER inclusive so PER is one less than the period */
+	TCC0->PERBUF.reg = TCC0->PER.reg = DCC_PERIOD_ONE - 1;
 
 	/* Enable TCC0 */
 	TCC0->CTRLA.reg |= TCC_CTRLA_ENABLE;
@@ -318,56 +1432,223 @@ void DCC_Init(DCC_Mode_t Mode)
 }
 
 
-void DCC_SendPacket(DCC_Packet_t *Packet)
+/* Get send ring for calling context */
+static DCC_SendRing_t *DCC_SendRingGet(void)
 {
-	PanicNull(Packet);
+	const uint32_t Exception = __get_IPSR();
+	if (Exception == 0)
+		return &DCC_SendRing[0];
+	else
+		return &DCC_SendRing[1 + NVIC_GetPriority((IRQn_Type)(Exception - 16))];
+}
+
+
+/* Sequence for a new request, the sum of the requests published to every ring.  Each count is
+   only written by its own producer and never goes down, so a request published before another
+   is submitted always has the lower sequence.  Requests submitted at the same time from nested
+   contexts may share a sequence, either order is then correct */
+static uint32_t DCC_SendSequence(void)
+{
+	uint32_t Sequence = 0;
+	for (uint8_t Index = 0; Index < DCC_SEND_RINGS; Index++)
+		Sequence += DCC_SendRing[Index].Published;
+	return Sequence;
+}
+
+
+/* Submit request to DCC task, can be called from tasks or interrupts.  Returns false if
+   request was dropped as the ring was full */
+static bool DCC_SendRequest(const DCC_SendRequest_t *Request)
+{
+	DCC_SendRing_t *Ring = DCC_SendRingGet();
+	while ((uint8_t)(Ring->Head - Ring->Tail) >= DCC_SEND_RING_SIZE)
+	{
+		/* Interrupts can't wait */
+		if (Ring != &DCC_SendRing[0])
+		{
+			Ring->Overflows += 1;
+			return false;
+		}
+		
+		/* Let DCC task empty the ring */
+		OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+		OS_Switch();
+	}
+	
+	/* Slot is claimed once the ring has space.  Other tasks sharing the ring only run when this
+	   one yields, and interrupts at the same level can't pre-empt each other, so nothing else
+	   can take the slot before Head is written.  Entry must be written before it's published */
+	const uint8_t Head = Ring->Head;
+	DCC_SendRequest_t *Entry = &Ring->Entry[Head % DCC_SEND_RING_SIZE];
+	*Entry = *Request;
+	Entry->Sequence = DCC_SendSequence();
+	__DMB();
+	Ring->Head = Head + 1;
+	Ring->Published += 1;
+	OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+	return true;
+}
+
+
+/* Returns false if there was no packet as its pool was empty, there's no signal to wait for then */
+static bool DCC_SubmitPacket(DCC_Packet_t *Packet, uint8_t Type)
+{
+	if (Packet == NULL)
+		return false;
 	PanicFalse(Packet->State == DCC_Packet_t::CREATED);
 
-	/* Add to send list */
-	Packet->Next = DCC_PacketSendList;
-	DCC_PacketSendList = Packet;
-	OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+	DCC_SendRequest_t Request = { Packet, 0, 0, Type, 0, 0 };
+	if (!DCC_SendRequest(&Request))
+	{
+		/* Dropped, inform client */
+		if (Packet->Signal)
+			OS_SignalSend(Packet->TaskId, Packet->Signal);
+		Packet->Release();
+	}
+	return true;
+}
+
+
+bool DCC_SendPacket(DCC_Packet_t *Packet)
+{
+	return DCC_SubmitPacket(Packet, DCC_SEND_PACKET);
+}
+
+
+/* Speed and function commands are applied by the DCC task to the packets it keeps for the
+   address, so only the first command for an address allocates a packet */
+static void DCC_SendUpdate(uint8_t Type, uint16_t Loco, uint8_t Value, uint8_t Param)
+{
+	DCC_SendRequest_t Request = { NULL, 0, Loco, Type, Value, Param };
+	DCC_SendRequest(&Request);
 }
 
 
-void DCC_SetLocomotiveSpeed(uint8_t Loco, uint8_t Speed, uint8_t Forward)
+void DCC_SetLocomotiveSpeed(uint16_t Loco, uint8_t Speed, uint8_t Forward)
 {
 	/* Skip E-Stop value of 0x01 */
 	if (Speed > 0)
 	Speed += 1;
 
-	DCC_SendPacket(new DCC_SpeedPacket_t(Loco, Speed, Forward));
+	DCC_SendUpdate(DCC_SEND_SPEED, Loco, Speed, Forward);
 }
 
 
-void DCC_StopLocomotive(uint8_t Loco, uint8_t Forward)
+void DCC_SetLocomotiveSpeedSteps(uint16_t Loco, uint8_t Steps)
 {
-	DCC_SendPacket(new DCC_SpeedPacket_t(Loco, 0x01, Forward));
+	if ((Steps != DCC_SPEED_STEPS_14) && (Steps != DCC_SPEED_STEPS_28) && (Steps != DCC_SPEED_STEPS_128))
+	{
+		Debug("Invalid speed steps %u\n", Steps);
+		return;
+	}
+	
+	DCC_SendUpdate(DCC_SEND_SPEED_STEPS, Loco, Steps, 0);
 }
 
 
-void DCC_SetLocomotiveFunctions(uint8_t Loco, uint8_t Functions, uint8_t Group)
+/* Consist is a short address, 1 - 127, or 0 to remove Loco from its consist.  Speed
+   commands for any member then control the whole consist, functions still go to members */
+void DCC_SetLocomotiveConsist(uint16_t Loco, uint8_t Consist, bool Reversed)
 {
-	if (Group < 13)
-	DCC_SendPacket(new DCC_FunctionPacket_t(Loco, Functions, Group));
-	else
-	DCC_SendPacket(new DCC_FunctionExpansionPacket_t(Loco, Functions, Group));
+	if (Consist > DCC_ADDRESS_SHORT_MAX)
+	{
+		Debug("Invalid consist %u\n", Consist);
+		return;
+	}
+	
+	DCC_SendUpdate(DCC_SEND_CONSIST, Loco, Consist, Reversed);
+}
+
+
+/* Queue operations mode write of CV on the main track, doesn't wait for it to be sent */
+void DCC_PomWrite(uint16_t Loco, uint16_t CvId, uint8_t Value)
+{
+	DCC_SubmitPacket(new DCC_CvMainWritePacket_t(Loco, CvId, Value), DCC_SEND_POM);
+}
+
+
+void DCC_PomWriteBit(uint16_t Loco, uint16_t CvId, uint8_t Bit, bool Value)
+{
+	DCC_SubmitPacket(new DCC_CvMainWritePacket_t(Loco, CvId, Bit, Value), DCC_SEND_POM);
+}
+
+
+/* Set speed step mode for Loco from CV29 of decoder on programming track.  Decoders that
+   support 28 steps must also accept 14/28 step packets, so use them as they're shortest.
+   Returns 0, leaving mode unchanged, if CV29 couldn't be read */
+uint8_t DCC_LearnLocomotiveSpeedSteps(uint16_t Loco)
+{
+	/* Batch read confirms the value, a single read returns 0 when there's no acknowledgment
+	   which would be taken as 14 steps */
+	static const uint16_t CvList[] = { 29 };
+	int16_t Config;
+	DCC_CvReadBatch_t Batch = { CvList, 0, 1, &Config, 0, false };
+	DCC_CvReadBatch(&Batch, 1 << 15);
+	while (!Batch.Complete)
+		OS_SignalWait(1 << 15);
+	if ((Batch.Done == 0) || (Config == DCC_CV_READ_FAILED))
+		return 0;
+	
+	// Bit 1 = Speed Step: "0" = 14 speed steps, "1" = 28/128 speed steps
+	const uint8_t Steps = (Config & 0x02) ? DCC_SPEED_STEPS_28 : DCC_SPEED_STEPS_14;
+	DCC_SetLocomotiveSpeedSteps(Loco, Steps);
+	return Steps;
+}
+
+
+void DCC_EmergencyStop(void)
+{
+	/* Broadcast stop bypasses send list and scheduler so it goes out at the next packet boundary */
+	DCC_TxEmergencyStop(DCC_ESTOP_REPEAT);
+	DCC_EStopPending = true;
+	OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+}
+
+
+void DCC_StopLocomotive(uint16_t Loco, uint8_t Forward)
+{
+	DCC_SendUpdate(DCC_SEND_SPEED, Loco, 0x01, Forward);
+}
+
+
+/* Set all functions in group, Group is the first function in the group */
+void DCC_SetLocomotiveFunctions(uint16_t Loco, uint8_t Functions, uint8_t Group)
+{
+	DCC_SendUpdate(DCC_SEND_FUNCTION_GROUP, Loco, Functions, Group);
+}
+
+
+void DCC_SetLocomotiveFunction(uint16_t Loco, uint8_t Function, bool On)
+{
+	DCC_SendUpdate(DCC_SEND_FUNCTION, Loco, Function, On ? DCC_FUNCTION_ON : DCC_FUNCTION_OFF);
+}
+
+
+void DCC_ToggleLocomotiveFunction(uint16_t Loco, uint8_t Function)
+{
+	DCC_SendUpdate(DCC_SEND_FUNCTION, Loco, Function, DCC_FUNCTION_TOGGLE);
+}
+
+
+void DCC_SetLocomotiveBinaryState(uint16_t Loco, uint16_t State, bool On)
+{
+	DCC_SendPacket(new DCC_BinaryStatePacket_t(Loco, State, On));
 }
 
 
 bool DCC_CvWrite(uint16_t CvId, uint8_t Value)
 {
 	OS_SignalSet_t Signal = 1 << 15;
-	bool Acked;
+	bool Acked = false;
 	
 	DCC_Mode = DCC_MODE_SERVICE;
 	
 	/* Send 3 or more reset packets */
-	DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal));
-	OS_SignalWait(Signal);
+	if (DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal)))
+		OS_SignalWait(Signal);
 	
-	DCC_SendPacket(new DCC_CvWritePacket_t(CvId, Value, &Acked, Signal));
-	OS_SignalWait(Signal);
+	if (DCC_SendPacket(new DCC_CvWritePacket_t(CvId, Value, &Acked, Signal)))
+		OS_SignalWait(Signal);
 	
 	//DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal));
 	//OS_SignalWait(Signal);
@@ -377,18 +1658,39 @@ bool DCC_CvWrite(uint16_t CvId, uint8_t Value)
 }
 
 
+/* Start reading batch of CVs from decoder on programming track, returns straight away.  Idle
+   packets are held off until the batch has finished */
+void DCC_CvReadBatch(DCC_CvReadBatch_t *Batch, OS_SignalSet_t Signal)
+{
+	DCC_Mode = DCC_MODE_SERVICE;
+	if (!DCC_SendPacket(new DCC_CvReadBatchPacket_t(Batch, Signal)))
+	{
+		/* Another batch is already being read */
+		Batch->Done = 0;
+		Batch->Complete = true;
+		DCC_Mode = DCC_MODE_NORMAL;
+	}
+}
+
+
+void DCC_ServiceModeComplete(void)
+{
+	DCC_Mode = DCC_MODE_NORMAL;
+}
+
+
 uint8_t DCC_CvRead(uint16_t CvId)
 {
 	OS_SignalSet_t Signal = (1 << 15);
-	uint8_t CvValue;
+	uint8_t CvValue = 0;
 	DCC_Mode = DCC_MODE_SERVICE;
 
 	/* Send 3 or more reset packets */
-	DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal));
-	OS_SignalWait(Signal);
+	if (DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal)))
+		OS_SignalWait(Signal);
 
-	DCC_SendPacket(new DCC_CvReadPacket_t(CvId, &CvValue, Signal));
-	OS_SignalWait(Signal);
+	if (DCC_SendPacket(new DCC_CvReadPacket_t(CvId, &CvValue, Signal)))
+		OS_SignalWait(Signal);
 	
 	//DCC_SendPacket(new DCC_ServicePacket_t(ResetPacket, sizeof(ResetPacket), Signal));
 	//OS_SignalWait(Signal);
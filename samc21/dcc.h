@@ -12,12 +12,87 @@
 #include "os.h"
 #include "rtime.h"
 
+/* Set to 1 to feed TCC0 pattern buffer by DMA rather than from the overflow interrupt */
+#ifndef DCC_TX_DMA
+#define DCC_TX_DMA	0
+#endif
+
+/* Highest function number, F0 - F68 */
+#define DCC_FUNCTION_MAX	(68)
+
+/* Speed step modes, locomotives use 128 steps unless configured otherwise.  14 and 28 step
+   packets are a byte shorter, so they take less track time to refresh */
+#define DCC_SPEED_STEPS_14		(14)
+#define DCC_SPEED_STEPS_28		(28)
+#define DCC_SPEED_STEPS_128		(128)
+#define DCC_SPEED_STEPS_DEFAULT	DCC_SPEED_STEPS_128
+
+/* Direction for DCC_StopLocomotive() that keeps the direction locomotive was last sent,
+   forward if it hasn't been sent a speed */
+#define DCC_DIRECTION_KEEP	(0xFF)
+
 typedef enum
 {
 	DCC_MODE_NORMAL,
 	DCC_MODE_SERVICE,
 } DCC_Mode_t;
 
+typedef struct
+{
+	const char *Name;
+	uint16_t Size;		// Size of each block in bytes
+	uint16_t NumBlocks;
+	uint16_t InUse;
+	uint16_t HighWater;
+	uint32_t Allocs;
+	uint32_t Overflows;	// Allocations refused as pool was empty
+} DCC_PoolStats_t;
+
+
+/* Scheduler statistics, counted since start or last reset.  Lag is time from when a packet
+   wanted to be sent until it started, counted in buckets with these upper limits */
+#define DCC_LAG_BUCKETS		(8)
+#define DCC_LAG_LIMITS_MS	{ 1, 2, 5, 10, 20, 50, 100 }
+
+typedef struct
+{
+	Time64_t Start;			// Time statistics were reset
+	uint64_t RealTime;		// Track time sending each class of packet in microseconds
+	uint64_t ServiceTime;
+	uint64_t IdleTime;
+	uint32_t RealPackets;
+	uint32_t ServicePackets;
+	uint32_t IdlePackets;
+	uint32_t Superseded;	// Queued packets replaced by a newer packet before being sent
+	uint32_t SendOverflows;	// Requests dropped from interrupts as send ring was full
+	uint32_t Refused;		// Commands dropped as address, consist or speed step tables were full
+	uint8_t SendHighWater;	// Most requests waiting in one send ring
+	uint8_t QueueHighWater;	// Most packets queued for one address
+	uint32_t Lag[DCC_LAG_BUCKETS];
+} DCC_Stats_t;
+
+typedef struct
+{
+	uint16_t Address;
+	uint8_t QueueHighWater;
+	uint32_t Lag[DCC_LAG_BUCKETS];
+} DCC_AddressStats_t;
+
+
+/* Batch of CVs to read in service mode.  Progress is reported by updating Done and signalling
+   the task that started the read after each CV, Complete is set once all CVs are read */
+#define DCC_CV_READ_FAILED	(-1)
+
+typedef struct
+{
+	const uint16_t *CvList;	// CVs to read, or NULL to read Count CVs from FirstCv
+	uint16_t FirstCv;
+	uint16_t Count;
+	int16_t *Values;		// Value of each CV, DCC_CV_READ_FAILED if it couldn't be confirmed
+	volatile uint16_t Done;
+	volatile bool Complete;
+} DCC_CvReadBatch_t;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,16 +103,34 @@ void DCC_Disable(void);
 
 bool DCC_CvWrite(uint16_t CvId, uint8_t Value);
 void DCC_CvVerify(uint16_t CvId, uint8_t Value);
+void DCC_PomWrite(uint16_t Loco, uint16_t CvId, uint8_t Value);
+void DCC_PomWriteBit(uint16_t Loco, uint16_t CvId, uint8_t Bit, bool Value);
 uint8_t DCC_CvRead(uint16_t CvId);
+void DCC_CvReadBatch(DCC_CvReadBatch_t *Batch, OS_SignalSet_t Signal);
 void DCC_TimerTick(void);
-void DCC_SetLocomotiveSpeed(uint8_t Loco, uint8_t Speed, uint8_t Forward);
-void DCC_SetLocomotiveFunctions(uint8_t Loco, uint8_t Functions, uint8_t Group);
-void DCC_StopLocomotive(uint8_t Loco, uint8_t Forward);
+void DCC_SetLocomotiveSpeed(uint16_t Loco, uint8_t Speed, uint8_t Forward);
+void DCC_SetLocomotiveSpeedSteps(uint16_t Loco, uint8_t Steps);
+uint8_t DCC_LearnLocomotiveSpeedSteps(uint16_t Loco);
+void DCC_SetLocomotiveConsist(uint16_t Loco, uint8_t Consist, bool Reversed);
+void DCC_SetLocomotiveFunctions(uint16_t Loco, uint8_t Functions, uint8_t Group);
+void DCC_SetLocomotiveFunction(uint16_t Loco, uint8_t Function, bool On);
+void DCC_ToggleLocomotiveFunction(uint16_t Loco, uint8_t Function);
+void DCC_SetLocomotiveBinaryState(uint16_t Loco, uint16_t State, bool On);
+void DCC_StopLocomotive(uint16_t Loco, uint8_t Forward);
+void DCC_EmergencyStop(void);
+void DCC_GetEmergencyStopLatency(uint32_t *Latency, uint32_t *LatencyMax);
+const DCC_PoolStats_t *DCC_GetPoolStats(uint8_t Index);
+uint8_t DCC_GetUtilisation(void);
+bool DCC_GetTrackFault(uint32_t *Count);
+const DCC_Stats_t *DCC_GetStats(void);
+const DCC_AddressStats_t *DCC_GetAddressStats(uint8_t Index);
+void DCC_ResetStats(void);
+
+/* Called from DCC task when track is blanked by an overcurrent fault and when power is restored */
+extern void CALLBACK_DCC_TrackFault(bool Fault);
 
 
-bool DCC_TxIsComplete(void);
-bool DCC_TxIsIdle(void);
-void DCC_TxIdle(void);
+void DCC_TxDmaInit(void);
 
 
 #ifdef __cplusplus
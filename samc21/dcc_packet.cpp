@@ -7,7 +7,9 @@
 
 #include <cstring>
 
+#include "dcc.h"
 #include "dcc_packet.h"
+#include "mem.h"
 #include "ac.h"
 #include "rtime.h"
 #include "debug.h"
@@ -15,13 +17,83 @@
 
 uint16_t PacketCount;
 
+
+/* Fixed size pool of blocks for one packet class, blocks are taken from the free list or
+   if that's empty from the unused part of the block array so no initialisation is required.
+   If the pool is exhausted new returns NULL, which callers must handle, and it's counted
+   as an overflow. */
+template <class T, uint16_t NumBlocks> class DCC_Pool_t
+{
+public:
+	DCC_Pool_t(const char *Name)
+	{
+		Stats.Name = Name;
+		Stats.Size = sizeof(T);
+		Stats.NumBlocks = NumBlocks;
+	}
+	
+	void *Alloc(void)
+	{
+		OS_InterruptDisable();
+		Block_t *Block = FreeList;
+		if (Block)
+			FreeList = Block->Next;
+		else if (Unused < NumBlocks)
+			Block = &Blocks[Unused++];
+		
+		Stats.Allocs += 1;
+		if (Block)
+		{
+			Stats.InUse += 1;
+			if (Stats.InUse > Stats.HighWater)
+				Stats.HighWater = Stats.InUse;
+		}
+		else
+			Stats.Overflows += 1;
+		OS_InterruptEnable();
+		return Block;
+	}
+	
+	void Free(void *Ptr)
+	{
+		Block_t *Block = (Block_t *)Ptr;
+		PanicFalse((Block >= &Blocks[0]) && (Block < &Blocks[NumBlocks]));
+		
+		OS_InterruptDisable();
+		Block->Next = FreeList;
+		FreeList = Block;
+		Stats.InUse -= 1;
+		OS_InterruptEnable();
+	}
+	
+	DCC_PoolStats_t Stats;
+	
+private:
+	union Block_t
+	{
+		Block_t *Next;
+		alignas(T) uint8_t Data[sizeof(T)];
+	};
+	
+	Block_t Blocks[NumBlocks];
+	Block_t *FreeList;
+	uint16_t Unused;
+};
+
+#define DCC_PACKET_POOL(Class, NumBlocks, Name) \
+	static DCC_Pool_t<Class, NumBlocks> Class##_Pool(Name); \
+	void *Class::operator new(size_t) noexcept { return Class##_Pool.Alloc(); } \
+	void Class::operator delete(void *Ptr) noexcept { Class##_Pool.Free(Ptr); }
+
 DCC_Packet_t::DCC_Packet_t(uint16_t Address)
 {
 	Next = NULL;
 	this->Address = Address;
 	AddressInfo = NULL;	
 	State = CREATED;
+	Priority = DCC_PRIORITY_COMMAND;
 	Cancelled = false;
+	Duration = 0;
 	PacketCount += 1;
 	//Debug("Create packet %u\n", PacketCount);
 }
@@ -35,6 +107,7 @@ DCC_Packet_t::~DCC_Packet_t()
 
 void DCC_Packet_t::Init(const uint8_t *Data, uint8_t Size, uint8_t PreambleBits, OS_SignalSet_t Signal)
 {
+	PanicFalse((Size <= sizeof(this->Data)) && (PreambleBits <= DCC_PREAMBLE_MAX));
 	if (Data)
 		memcpy(this->Data, Data, Size);
 	this->Size = Size;
@@ -43,36 +116,128 @@ void DCC_Packet_t::Init(const uint8_t *Data, uint8_t Size, uint8_t PreambleBits,
 	this->Signal = Signal;
 }
 
+/* Convert locomotive number to packet address, 1 - 127 use short addresses, 128 - 10239 use long addresses */
+uint16_t DCC_Packet_t::LocoAddress(uint16_t Loco)
+{
+	PanicFalse(Loco <= DCC_ADDRESS_LONG_MAX);
+	if (Loco > DCC_ADDRESS_SHORT_MAX)
+		return DCC_ADDRESS_LONG | Loco;
+	else
+		return Loco;
+}
 
+/* Write address to start of packet, returns number of bytes written */
+uint8_t DCC_Packet_t::InitAddress(uint8_t *Packet) const
+{
+	// The first data byte of an Extended Packet Format packet contains the primary address.
+	// Addresses 11000000-11100111 (192-231) indicate a multi function decoder with a 14 bit
+	// address, the second byte contains the remaining 8 bits of the address.
+	if (Address & DCC_ADDRESS_LONG)
+	{
+		Packet[0] = Address >> 8;
+		Packet[1] = Address & 0xFF;
+		return 2;
+	}
+	else
+	{
+		Packet[0] = Address;
+		return 1;
+	}
+}
+
+static uint8_t DCC_Checksum(const uint8_t *Packet, uint8_t Size)
+{
+	uint8_t Checksum = 0;
+	while (Size--)
+		Checksum ^= *Packet++;
+	return Checksum;
+}
 
-DCC_SpeedPacket_t::DCC_SpeedPacket_t(uint8_t Address, uint8_t Speed, uint8_t Forward) : DCC_Packet_t(Address)
+
+
+DCC_SpeedPacket_t::DCC_SpeedPacket_t(DCC_AddressInfo_t *AddressInfo, uint8_t Steps) : DCC_Packet_t(AddressInfo->Address)
 { 
-	uint8_t Packet[4];
+	/* Packet is only created for an address, so it can look at FL state in 14 step mode */
+	this->AddressInfo = AddressInfo;
+	this->Steps = Steps;
+	Init(NULL, 0, 14, 0);
+	Update(0, 1);
+}
 
-	// The format of this instruction is 001CCCCC  0  DDDDDDDD
-	// The 5-bit sub-instruction CCCCC allows for 32 separate Advanced Operations Sub-Instructions.
+DCC_SpeedPacket_t::~DCC_SpeedPacket_t()
+{
+	/* Invalidate handle so next speed command creates a new packet */
+	if (AddressInfo && (AddressInfo->SpeedPacket == this))
+		AddressInfo->SpeedPacket = NULL;
+}
+
+void DCC_SpeedPacket_t::Update(uint8_t Speed, uint8_t Forward)
+{
+	this->Speed = Speed;
+	this->Forward = Forward;
 	
-	// CCCCC = 11111: 128 Speed Step Control - Instruction "11111" is used to send one of 126 Digital
-	// Decoder speed steps.  The subsequent single byte shall define speed and direction with bit 7
-	// being direction ("1" is forward and "0" is reverse) and the remaining bits used to indicate
-	// speed.  The most significant speed bit is bit 6. A data-byte value of U0000000 is used for stop,
-	// and a data-byte value of U0000001 is used for emergency stop. This allows up to 126 speed steps.
-	// When operations mode acknowledgment is enabled, receipt of a 128 Speed Step Control packet must
-	// be acknowledged with an operations mode acknowledgment.
-	Packet[0] = Address;
-	Packet[1] = 0b00111111;
-	if (Forward)
-		Packet[2] = 0x80;
+	uint8_t Size = InitAddress(Data);
+	if (Steps == DCC_SPEED_STEPS_128)
+	{
+		// The format of this instruction is 001CCCCC  0  DDDDDDDD
+		// The 5-bit sub-instruction CCCCC allows for 32 separate Advanced Operations Sub-Instructions.
+		
+		// CCCCC = 11111: 128 Speed Step Control - Instruction "11111" is used to send one of 126 Digital
+		// Decoder speed steps.  The subsequent single byte shall define speed and direction with bit 7
+		// being direction ("1" is forward and "0" is reverse) and the remaining bits used to indicate
+		// speed.  The most significant speed bit is bit 6. A data-byte value of U0000000 is used for stop,
+		// and a data-byte value of U0000001 is used for emergency stop. This allows up to 126 speed steps.
+		// When operations mode acknowledgment is enabled, receipt of a 128 Speed Step Control packet must
+		// be acknowledged with an operations mode acknowledgment.
+		Data[Size++] = 0b00111111;
+		if (Forward)
+			Data[Size] = 0x80;
+		else
+			Data[Size] = 0x00;
+		
+		Data[Size++] |= Speed;
+	}
 	else
-		Packet[2] = 0x00;
-	
-	Packet[2] |= Speed;
-	Packet[3] = Packet[0] ^ Packet[1] ^ Packet[2];
+	{
+		// Speed and Direction Instructions (010 and 011)
+		// These two instructions have these formats:
+		//     for Reverse Operation   010DDDDD
+		//     for Forward Operation   011DDDDD
+		// Bits 0-3 provide 14 speed steps, 0 is stop and 1 is emergency stop.  If bit 1 of CV#29 has
+		// a value of one (1), then bit 4 is used as an intermediate speed step to give 28 speed steps,
+		// otherwise bit 4 controls function FL.
+		uint8_t Instruction = Forward ? 0b01100000 : 0b01000000;
+		
+		/* Scale steps 1 - 126 down to 1 - 14 or 1 - 28, keeping stop and emergency stop values */
+		uint8_t Step = Speed;
+		if (Speed > 1)
+			Step = 2 + ((Speed - 2) * Steps) / 126;
+		
+		if (Steps == DCC_SPEED_STEPS_28)
+		{
+			/* Steps are interleaved, bit 4 is least significant bit of step + 3.  Stop and
+			   emergency stop have bit 4 clear */
+			if (Step > 1)
+				Step += 2;
+			else
+				Step <<= 1;
+			Instruction |= (Step >> 1) | ((Step & 0x01) << 4);
+		}
+		else
+		{
+			Instruction |= Step;
+			if (AddressInfo && (AddressInfo->FunctionState[0] & 0x10))
+				Instruction |= 0x10;
+		}
+		Data[Size++] = Instruction;
+	}
+	Data[Size] = DCC_Checksum(Data, Size);
+	this->Size = Size + 1;
 	
 	Repeat = (Speed != 0);
 	TxCount = 0;
-	
-	Init(Packet, sizeof(Packet), 14, 0);
+	Cancelled = false;
+	Priority = (Speed == 0x01) ? DCC_PRIORITY_EMERGENCY : DCC_PRIORITY_COMMAND;
 }
 
 bool DCC_SpeedPacket_t::Schedule(uint32_t &Time)
@@ -85,10 +250,10 @@ bool DCC_SpeedPacket_t::Schedule(uint32_t &Time)
 	}
 	else
 	{
-		//return false;
 		if (Repeat)
 		{
-			Scheduled = Time_Add(Scheduled, DCC_MS(500));
+			Priority = DCC_PRIORITY_REFRESH;
+			Scheduled = Time_Add(Scheduled, DCC_RefreshPeriod(this, DCC_MS(500), DCC_REFRESH_MOVING));
 			Time = Scheduled;
 			return true;
 		}
@@ -99,8 +264,10 @@ bool DCC_SpeedPacket_t::Schedule(uint32_t &Time)
 
 bool DCC_SpeedPacket_t::IsSame(const DCC_Packet_t *Packet)
 {
-	return (Packet->Data[0] == Data[0]) &&
-		   (Packet->Data[1] == 0b00111111);
+	/* 128 step control or speed and direction instruction */
+	const uint8_t Instruction = Packet->Data[AddressSize()];
+	return (Packet->Address == Address) &&
+		   ((Instruction == 0b00111111) || ((Instruction & 0b11000000) == 0b01000000));
 }
 
 void DCC_SpeedPacket_t::PacketStart()
@@ -117,10 +284,41 @@ void DCC_SpeedPacket_t::PacketEnd()
 
 
 
-DCC_FunctionPacket_t::DCC_FunctionPacket_t(uint8_t Address, uint8_t Functions, uint8_t StartFunction) : DCC_Packet_t(Address)
+/* Number of times a changed function group is sent before it's only refreshed */
+#define DCC_FUNCTION_BURST (3)
+
+/* Instruction for each function group, the first three groups have their data in the instruction byte */
+static const uint8_t DCC_FunctionInstruction[DCC_FUNCTION_GROUPS] =
+{
+	0b10000000,	/* F0 - F4 */
+	0b10110000,	/* F5 - F8 */
+	0b10100000,	/* F9 - F12 */
+	0b11011110,	/* F13 - F20 */
+	0b11011111,	/* F21 - F28 */
+	0b11011000,	/* F29 - F36 */
+	0b11011001,	/* F37 - F44 */
+	0b11011010,	/* F45 - F52 */
+	0b11011011,	/* F53 - F60 */
+	0b11011100,	/* F61 - F68 */
+};
+
+DCC_FunctionPacket_t::DCC_FunctionPacket_t(DCC_AddressInfo_t *AddressInfo) : DCC_Packet_t(AddressInfo->Address)
+{
+	/* Packet is only created for an address, so it can look at function state when first scheduled */
+	this->AddressInfo = AddressInfo;
+	Group = DCC_FUNCTION_GROUPS - 1;
+	BurstCount = 0;
+	Init(NULL, 0, 14, 0);
+}
+
+DCC_FunctionPacket_t::~DCC_FunctionPacket_t()
 {
-	uint8_t Packet[3];
+	if (AddressInfo && (AddressInfo->FunctionPacket == this))
+		AddressInfo->FunctionPacket = NULL;
+}
 
+void DCC_FunctionPacket_t::Encode(uint8_t Group)
+{
 	// Function Group One Instruction (100)
 	// The format of this instruction is 100DDDDD
 	// Up to 5 auxiliary functions (functions FL and F1-F4) can be controlled by the Function Group One
@@ -130,55 +328,76 @@ DCC_FunctionPacket_t::DCC_FunctionPacket_t(uint8_t Address, uint8_t Functions, u
 	// value of one (1), then bit 4 controls function FL, otherwise bit 4 has no meaning. When operations
 	// mode acknowledgment is enabled, receipt of a function group 1 packet must be acknowledged according
 	// with an operations mode acknowledgment.
-	Packet[0] = Address;
-	switch (StartFunction)
+	//
+	// Function Group Two Instruction (101), 1011DDDD for F5-F8 and 1010DDDD for F9-F12.
+	//
+	// Feature Expansion Instruction (110), 110CCCCC DDDDDDDD with F13-F20 (11110), F21-F28 (11111),
+	// F29-F36 (11000), F37-F44 (11001), F45-F52 (11010), F53-F60 (11011) and F61-F68 (11100).
+	this->Group = Group;
+	uint8_t Size = InitAddress(Data);
+	const uint8_t State = AddressInfo->FunctionState[Group];
+	if (Group < 3)
+		Data[Size++] = DCC_FunctionInstruction[Group] | State;
+	else
 	{
-		case 0: /* F1 - F4 + FL */
-			Packet[1] = 0b10000000 | (Functions & 0b11111);
-			Mask = 0b11100000;
-			break;
-		
-		case 5: /* F5 - F8 */
-			Packet[1] = 0b10110000 | (Functions & 0b01111);
-			Mask = 0b11110000;
-			break;
-		
-		case 9: /* F9 - F12 */
-			Packet[1] = 0b10100000 | (Functions & 0b01111);
-			Mask = 0b11110000;
-			break;
+		Data[Size++] = DCC_FunctionInstruction[Group];
+		Data[Size++] = State;
 	}
-	Packet[2] = Packet[0] ^ Packet[1];
-	Debug("FN: %02x %02x\n", Packet[0], Packet[1]);
-
-	TxCount = 0;
-	Init(Packet, sizeof(Packet), 14, 0);
+	Data[Size] = DCC_Checksum(Data, Size);
+	this->Size = Size + 1;
 }
 
-
-
 bool DCC_FunctionPacket_t::Schedule(uint32_t &Time)
 {
-	TxCount += 1;
-	if (TxCount < 4)
+	/* Group being sent has changed again, so start its burst again with the new state */
+	if (AddressInfo->FunctionChanged & (1U << Group))
+		BurstCount = 0;
+	
+	/* Finish burst of changed group */
+	if (BurstCount)
 	{
+		BurstCount -= 1;
 		Scheduled = Time;
 		return true;
 	}
-	else
+	
+	/* Send changed groups straight away as commands, lowest group first */
+	if (AddressInfo->FunctionChanged)
 	{
-		return false;
-		Scheduled = Time_Add(Scheduled, DCC_MS(1000));
-		Time = Scheduled;
+		uint8_t Changed = 0;
+		while (!(AddressInfo->FunctionChanged & (1U << Changed)))
+			Changed += 1;
+		AddressInfo->FunctionChanged &= ~(1U << Changed);
+		
+		Encode(Changed);
+		BurstCount = DCC_FUNCTION_BURST - 1;
+		Priority = DCC_PRIORITY_COMMAND;
+		Scheduled = Time;
 		return true;
 	}
-}
-
-
-bool DCC_FunctionPacket_t::IsSame(const DCC_Packet_t *Packet)
-{
-	return false;
-	//return (Packet->Data[0] == Data[0]) && ((Packet->Data[1] & Mask) == (Data[1] & Mask));
+	
+	/* Only groups with functions on need refreshing */
+	uint8_t NumActive = 0;
+	for (uint8_t Index = 0; Index < DCC_FUNCTION_GROUPS; Index++)
+	{
+		if (AddressInfo->FunctionState[Index])
+			NumActive += 1;
+	}
+	if (NumActive == 0)
+		return false;
+	
+	/* Refresh next group in rotation, period is shared between groups so each group is
+	   refreshed at the background rate however many groups there are */
+	uint8_t Next = Group;
+	do
+		Next = (Next + 1) % DCC_FUNCTION_GROUPS;
+	while (AddressInfo->FunctionState[Next] == 0);
+	
+	Encode(Next);
+	Priority = DCC_PRIORITY_REFRESH;
+	Scheduled = Time_Add(Scheduled, DCC_RefreshPeriod(this, DCC_MS(1000), DCC_REFRESH_BACKGROUND) / NumActive);
+	Time = Scheduled;
+	return true;
 }
 
 void DCC_FunctionPacket_t::PacketStart()
@@ -194,59 +413,88 @@ void DCC_FunctionPacket_t::PacketEnd()
 
 
 
+DCC_BinaryStatePacket_t::DCC_BinaryStatePacket_t(uint16_t Address, uint16_t State, bool On) : DCC_Packet_t(LocoAddress(Address))
+{
+	uint8_t Packet[6];
+	
+	// Binary State Control Instruction Short Form 11011101 DLLLLLLL, for states 1 - 127, state 0
+	// addresses all states.  Long Form 11000000 DLLLLLLL HHHHHHHH, for states up to 32767.  D is
+	// the state, LLLLLLL the low and HHHHHHHH the high bits of the state number.
+	uint8_t Size = InitAddress(Packet);
+	if (State < 128)
+	{
+		Packet[Size++] = 0b11011101;
+		Packet[Size++] = (On ? 0x80 : 0x00) | State;
+	}
+	else
+	{
+		PanicFalse(State < 32768);
+		Packet[Size++] = 0b11000000;
+		Packet[Size++] = (On ? 0x80 : 0x00) | (State & 0x7F);
+		Packet[Size++] = State >> 7;
+	}
+	Packet[Size] = DCC_Checksum(Packet, Size);
+	Size += 1;
+	
+	TxCount = 0;
+	Init(Packet, Size, 14, 0);
+}
 
+bool DCC_BinaryStatePacket_t::Schedule(uint32_t &)
+{
+	/* Binary states aren't refreshed */
+	TxCount += 1;
+	return (TxCount <= DCC_FUNCTION_BURST);
+}
 
+bool DCC_BinaryStatePacket_t::IsSame(const DCC_Packet_t *Packet)
+{
+	/* Same state number, for either form of the instruction */
+	const uint8_t Index = AddressSize();
+	if ((Packet->Address != Address) || (Packet->Data[Index] != Data[Index]) ||
+		((Packet->Data[Index + 1] & 0x7F) != (Data[Index + 1] & 0x7F)))
+		return false;
+	return (Data[Index] == 0b11011101) || (Packet->Data[Index + 2] == Data[Index + 2]);
+}
 
 
 
 
-DCC_FunctionExpansionPacket_t::DCC_FunctionExpansionPacket_t(uint8_t Address, uint8_t Functions, uint8_t StartFunction) : DCC_Packet_t(Address)
-{
-	uint8_t Packet[4];
 
-	Packet[0] = Address;
-	switch (StartFunction)
-	{
-		case 13:
-			Packet[1] = 0b11011110;
-			break;
-		case 21:
-			Packet[1] = 0b11011111;
-			break;		
-		case 29:
-			Packet[1] = 0b11011000;
-			break;
-	}
-	Packet[2] = Functions;
-	Packet[3] = Packet[0] ^ Packet[1] ^ Packet[2];
-	Debug("FNE: %02x %02x %02x\n", Packet[0], Packet[1], Packet[2]);
 
+/* Number of times consist control is sent, it isn't refreshed */
+#define DCC_CONSIST_REPEAT (3)
+
+DCC_ConsistControlPacket_t::DCC_ConsistControlPacket_t(uint16_t Address, uint8_t Consist, bool Reversed) : DCC_Packet_t(LocoAddress(Address))
+{
+	uint8_t Packet[6];
+	
+	// Consist Control (0001)
+	// The format of this instruction is 0001CCCC 0AAAAAAA
+	// CCCC = 0010 or 0011: Set the consist address as specified in the byte 0AAAAAAA, and store it in
+	// CV#19 bits 0-6.  The direction of this unit in the consist is the normal direction (0010) or the
+	// reverse of the normal direction (0011), stored in bit 7 of CV#19.  A consist address of 0000000
+	// deactivates the consist.
+	uint8_t Size = InitAddress(Packet);
+	Packet[Size++] = Reversed ? 0b00010011 : 0b00010010;
+	Packet[Size++] = Consist & 0x7F;
+	Packet[Size] = DCC_Checksum(Packet, Size);
+	Size += 1;
+	
 	TxCount = 0;
-	Init(Packet, sizeof(Packet), 14, 0);
+	Init(Packet, Size, 14, 0);
 }
 
-
-
-bool DCC_FunctionExpansionPacket_t::Schedule(uint32_t &Time)
+bool DCC_ConsistControlPacket_t::Schedule(uint32_t &)
 {
 	TxCount += 1;
-	if (TxCount < 4)
-	{
-		Scheduled = Time;
-		return true;
-	}
-	else
-	{
-		Scheduled = Time_Add(Scheduled, DCC_MS(1000));
-		Time = Scheduled;
-		return true;		
-	}
+	return (TxCount <= DCC_CONSIST_REPEAT);
 }
 
-
-bool DCC_FunctionExpansionPacket_t::IsSame(const DCC_Packet_t *Packet)
+bool DCC_ConsistControlPacket_t::IsSame(const DCC_Packet_t *Packet)
 {
-	return (Packet->Data[0] == Data[0]) && (Packet->Data[1] == Data[1]);
+	return (Packet->Address == Address) &&
+		   ((Packet->Data[AddressSize()] & 0b11111110) == 0b00010010);
 }
 
 
@@ -254,10 +502,11 @@ bool DCC_FunctionExpansionPacket_t::IsSame(const DCC_Packet_t *Packet)
 
 
 
-DCC_IdlePacket_t::DCC_IdlePacket_t(void) : DCC_Packet_t(0xFF)
+DCC_IdlePacket_t::DCC_IdlePacket_t(void) : DCC_Packet_t(DCC_ADDRESS_IDLE)
 {
 	static const uint8_t Packet[] = { 0xFF, 0x00, 0xFF };
 	Init(Packet, sizeof(Packet), 14, 0);
+	Priority = DCC_PRIORITY_IDLE;
 	Scheduled = false;
 }
 
@@ -283,6 +532,25 @@ void DCC_IdlePacket_t::PacketEnd()
 {
 }
 
+void DCC_IdlePacket_t::Release()
+{
+	Next = NULL;
+	AddressInfo = NULL;
+	State = CREATED;
+	Scheduled = false;
+}
+
+
+
+
+DCC_EmergencyStopPacket_t::DCC_EmergencyStopPacket_t(void) : DCC_Packet_t(DCC_ADDRESS_BROADCAST)
+{
+	// Speed and Direction Instruction 01DCSSSS with SSSS = 0001 and C = 1, stop immediately with direction ignored
+	static const uint8_t Packet[] = { 0x00, 0b01010001, 0b01010001 };
+	Init(Packet, sizeof(Packet), 14, 0);
+	Priority = DCC_PRIORITY_EMERGENCY;
+}
+
 
 
 
@@ -293,30 +561,73 @@ DCC_ServicePacket_t::DCC_ServicePacket_t(const uint8_t *Data, uint8_t DataSize,
 	Init(Data, DataSize, 20, Signal);
 }
 
-bool DCC_ServicePacket_t::Schedule(uint32_t &Time)
+bool DCC_ServicePacket_t::Schedule(uint32_t &)
 {
 	TxCount += 1;
 	return (TxCount <= 5);
 }
 
 
-#if 0
-DCC_CvMainWritePacket_t::DCC_CvMainWritePacket_t(uint8_t Address, uint16_t CvId, uint8_t Value, OS_SignalSet_t Signal) : DCC_Packet_t(0)
+/* Operations mode packets are spaced so they use at most 1/DCC_POM_SHARE of track time */
+#define DCC_POM_SHARE	(4)
+
+/* Decoder acts on CV access once it has received two identical packets, send a few more in
+   case one is corrupted */
+#define DCC_POM_REPEAT	(4)
+
+DCC_CvMainWritePacket_t::DCC_CvMainWritePacket_t(uint16_t Address, uint16_t CvId, uint8_t Value) : DCC_Packet_t(LocoAddress(Address))
 {
-	uint8_t Packet[5];
+	// Configuration Variable Access Instruction - Long Form (1110)
+	// The format of this instruction is 1110CCVV 0 VVVVVVVV 0 DDDDDDDD
+	// CC=11 Write byte, the 10 bit CV number VV VVVVVVVV is the CV number minus 1
+	Encode(CvId, 0b11, Value);
+}
 
-	Data[0] = Address;
+DCC_CvMainWritePacket_t::DCC_CvMainWritePacket_t(uint16_t Address, uint16_t CvId, uint8_t Bit, bool Value) : DCC_Packet_t(LocoAddress(Address))
+{
+	// CC=10 Bit manipulation, DDDDDDDD is 111KDBBB where K=1 writes bit BBB with value D
+	Encode(CvId, 0b10, 0b11110000 | (Value ? 0x08 : 0x00) | (Bit & 0x07));
+}
 
+void DCC_CvMainWritePacket_t::Encode(uint16_t CvId, uint8_t Operation, uint8_t Value)
+{
 	CvId -= 1;
 	
-	Data[1] = 0xEC | ((CvId >> 8) & 0x03);  
-	Data[2] = CvId & 0xFF;
-	Data[3] = Value;
-	Data[4] = Packet[0] ^ Packet[1] ^ Packet[2] ^ Packet[3];
+	uint8_t Size = InitAddress(Data);
+	Data[Size++] = 0b11100000 | (Operation << 2) | ((CvId >> 8) & 0x03);
+	Data[Size++] = CvId & 0xFF;
+	Data[Size++] = Value;
+	Data[Size] = DCC_Checksum(Data, Size);
+	
+	TxCount = 0;
+	Priority = DCC_PRIORITY_REFRESH;
+	Init(NULL, Size + 1, 14, 0);
+}
 
-	Init(NULL, 5, 14, Signal);
+bool DCC_CvMainWritePacket_t::Schedule(uint32_t &Time)
+{
+	/* First packet can go as soon as it's queued, space the rest after the last one sent by a
+	   multiple of the time it took to send */
+	if (TxCount == 0)
+		NextTime = Time;
+	else
+		NextTime = Time_Add(Scheduled, Duration * DCC_POM_SHARE);
+	
+	TxCount += 1;
+	if (TxCount > DCC_POM_REPEAT)
+		return false;
+	
+	if (Time_Sub(NextTime, Time) > 0)
+		Time = NextTime;
+	Scheduled = Time;
+	return true;
+}
+
+void DCC_CvMainWritePacket_t::Release(void)
+{
+	DCC_PomComplete(this);
+	delete this;
 }
-#endif
 
 
 
@@ -346,20 +657,20 @@ void DCC_CvWritePacket_t::PacketStart(void)
 	AC_ResetTriggerCount();
 }
 
-uint16_t DCC_CvWritePacket_t::DataEnd(void)
+uint16_t DCC_CvWritePacket_t::Gap(void)
 {
-	return 155;
+	return 8990;
 }
 
 void DCC_CvWritePacket_t::PacketEnd(void)
 {
-	if (AC_DisableTrigger() > 5000)
+	if (AC_DisableTrigger() >= AC_ACK_MIN)
 		*AckPtr = true;
 	TxCount += 1;
 }
 
 
-bool DCC_CvWritePacket_t::Schedule(uint32_t &Time)
+bool DCC_CvWritePacket_t::Schedule(uint32_t &)
 {
 	if (*AckPtr)
 		return false;
@@ -397,21 +708,25 @@ void DCC_CvReadPacket_t::PacketStart(void)
 	PIO_Set(PIN_PA20);
 }
 
-uint16_t DCC_CvReadPacket_t::DataEnd(void)
+uint16_t DCC_CvReadPacket_t::Gap(void)
+{
+	return 6090;
+}
+
+void DCC_CvReadPacket_t::DataEnd(void)
 {
 	PIO_Clear(PIN_PA20);
-	return 105;
 }
 
 void DCC_CvReadPacket_t::PacketEnd(void)
 {
 	uint8_t Bit = TxCount / 3;
-	if (AC_DisableTrigger() > 5000)
+	if (AC_DisableTrigger() >= AC_ACK_MIN)
 		*ValuePtr |= (1 << Bit);
 	TxCount += 1;	
 }
 
-bool DCC_CvReadPacket_t::Schedule(uint32_t &Time)
+bool DCC_CvReadPacket_t::Schedule(uint32_t &)
 {
 	uint8_t Bit = TxCount / 3;
 	if (Bit < 8)
@@ -422,4 +737,186 @@ bool DCC_CvReadPacket_t::Schedule(uint32_t &Time)
 	}
 	else
 		return false;
-}
\ No newline at end of file
+}
+
+
+
+/* Reset packets sent before first CV is read */
+#define DCC_BATCH_RESETS	(5)
+
+/* Bit verify packets sent for each bit, retry is used once confirmation has failed.  Decoders
+   may need more than one packet before they acknowledge, so repeat matches a single CV read */
+#ifndef DCC_BATCH_BIT_REPEAT
+#define DCC_BATCH_BIT_REPEAT	(3)
+#endif
+#define DCC_BATCH_BIT_RETRY		(3)
+
+DCC_CvReadBatchPacket_t::DCC_CvReadBatchPacket_t(DCC_CvReadBatch_t *Batch, OS_SignalSet_t Signal) : DCC_Packet_t(0)
+{
+	this->Batch = Batch;
+	Batch->Done = 0;
+	Batch->Complete = false;
+	
+	Phase = RESET;
+	TxCount = 0;
+	Bit = 0;
+	Value = 0;
+	Retry = false;
+	Sent = false;
+	Init(NULL, 0, 20, Signal);
+}
+
+void DCC_CvReadBatchPacket_t::PacketStart(void)
+{
+	AC_EnableTrigger();
+	AC_ResetTriggerCount();
+}
+
+uint16_t DCC_CvReadBatchPacket_t::Gap(void)
+{
+	/* Time for decoder to acknowledge */
+	return (Phase == RESET) ? 0 : 6090;
+}
+
+void DCC_CvReadBatchPacket_t::PacketEnd(void)
+{
+	Acked = (AC_DisableTrigger() >= AC_ACK_MIN);
+	Sent = true;
+}
+
+/* Move to next packet given result of the last one */
+void DCC_CvReadBatchPacket_t::Result(bool Acked)
+{
+	if (Phase == RESET)
+	{
+		if (++TxCount < DCC_BATCH_RESETS)
+			return;
+	}
+	else if (Phase == BIT)
+	{
+		/* Acknowledge means bit is 1, so there's no need to repeat it */
+		if (Acked)
+			Value |= 1 << Bit;
+		else if (++TxCount < (Retry ? DCC_BATCH_BIT_RETRY : DCC_BATCH_BIT_REPEAT))
+			return;
+		
+		TxCount = 0;
+		if (++Bit < 8)
+			return;
+		Phase = VERIFY;
+		return;
+	}
+	else
+	{
+		/* Byte verify failed, re-read bits with more repeats before giving up */
+		if (!Acked && !Retry)
+			Retry = true;
+		else
+		{
+			Batch->Values[Batch->Done] = Acked ? Value : DCC_CV_READ_FAILED;
+			Batch->Done += 1;
+			if (Signal)
+				OS_SignalSend(TaskId, Signal);
+			Retry = false;
+		}
+	}
+	
+	/* Start reading next CV, or same CV again on retry */
+	Phase = BIT;
+	TxCount = 0;
+	Bit = 0;
+	Value = 0;
+}
+
+/* Write packet data for current phase */
+void DCC_CvReadBatchPacket_t::Encode(void)
+{
+	if (Phase == RESET)
+	{
+		Data[0] = Data[1] = Data[2] = 0x00;
+		Size = 3;
+		PreambleBits = 20;
+		return;
+	}
+	
+	/* FFS - Hidden in the documentation "The Configuration variable being addressed is
+	   the provided 10 bit address plus 1.  CV #1 is defined by the address 00 00000000" */
+	const uint16_t CvId = Batch->CvList ? Batch->CvList[Batch->Done] : Batch->FirstCv + Batch->Done;
+	const uint16_t Address = CvId - 1;
+
+	/* Long-preamble   0  0111CCAA  0  AAAAAAAA  0  DDDDDDDD  0  EEEEEEEE  1
+	   CC=01 Verify byte, CC=10 Bit manipulation with DDDDDDDD = 111KDBBB, K=0 to verify bit */
+	if (Phase == BIT)
+	{
+		Data[0] = 0b01111000 | (Address >> 8);
+		Data[2] = 0b11101000 | Bit;  // Verify if bit is 1
+	}
+	else
+	{
+		Data[0] = 0b01110100 | (Address >> 8);
+		Data[2] = Value;
+	}
+	Data[1] = Address & 0xFF;
+	Data[3] = Data[0] ^ Data[1] ^ Data[2];
+	Size = 4;
+	PreambleBits = 14;
+}
+
+bool DCC_CvReadBatchPacket_t::Schedule(uint32_t &)
+{
+	if (Sent)
+	{
+		Sent = false;
+		Result(Acked);
+	}
+	
+	if (Batch->Done >= Batch->Count)
+	{
+		Batch->Complete = true;
+		return false;
+	}
+	
+	Encode();
+	return true;
+}
+
+void DCC_CvReadBatchPacket_t::Release(void)
+{
+	DCC_ServiceModeComplete();
+	delete this;
+}
+
+
+
+/* Pools sized for the expected number of outstanding packets of each class.  There's at most
+   one speed packet and one function packet per address, so those pools never run out */
+DCC_PACKET_POOL(DCC_SpeedPacket_t, DCC_ADDRESS_INFO_MAX, "Speed")
+DCC_PACKET_POOL(DCC_FunctionPacket_t, DCC_ADDRESS_INFO_MAX, "Function")
+DCC_PACKET_POOL(DCC_BinaryStatePacket_t, 4, "BinaryState")
+DCC_PACKET_POOL(DCC_ConsistControlPacket_t, 4, "Consist")
+DCC_PACKET_POOL(DCC_CvMainWritePacket_t, 4, "CvMainWrite")
+DCC_PACKET_POOL(DCC_ServicePacket_t, 2, "Service")
+DCC_PACKET_POOL(DCC_CvWritePacket_t, 1, "CvWrite")
+DCC_PACKET_POOL(DCC_CvReadPacket_t, 1, "CvRead")
+DCC_PACKET_POOL(DCC_CvReadBatchPacket_t, 1, "CvReadBatch")
+
+static const DCC_PoolStats_t *const DCC_PoolStatsTable[] =
+{
+	&DCC_SpeedPacket_t_Pool.Stats,
+	&DCC_FunctionPacket_t_Pool.Stats,
+	&DCC_BinaryStatePacket_t_Pool.Stats,
+	&DCC_ConsistControlPacket_t_Pool.Stats,
+	&DCC_CvMainWritePacket_t_Pool.Stats,
+	&DCC_ServicePacket_t_Pool.Stats,
+	&DCC_CvWritePacket_t_Pool.Stats,
+	&DCC_CvReadPacket_t_Pool.Stats,
+	&DCC_CvReadBatchPacket_t_Pool.Stats,
+};
+
+/* Get statistics for packet pool, returns NULL if index is past the last pool */
+const DCC_PoolStats_t *DCC_GetPoolStats(uint8_t Index)
+{
+	if (Index < sizeof(DCC_PoolStatsTable) / sizeof(DCC_PoolStatsTable[0]))
+		return DCC_PoolStatsTable[Index];
+	return NULL;
+}
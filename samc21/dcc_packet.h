@@ -16,13 +16,73 @@
 #define DCC_MS(x)	((x) * 1000)
 
 class DCC_Packet_t;
+class DCC_SpeedPacket_t;
+class DCC_FunctionPacket_t;
+
+/* Packet classes are allocated from fixed size pools rather than the general heap, the
+   pools are defined in dcc_packet.cpp using DCC_PACKET_POOL().  New returns NULL once the
+   pool is empty */
+#define DCC_PACKET_POOLED \
+	static void *operator new(size_t Size) noexcept; \
+	static void operator delete(void *Ptr) noexcept;
+
+/* Long addresses are stored with the two top bits set, as they appear in the first
+   byte of the packet, so they can never be confused with short or special addresses */
+#define DCC_ADDRESS_LONG		(0xC000)
+#define DCC_ADDRESS_SHORT_MAX	(127)
+#define DCC_ADDRESS_LONG_MAX	(10239)
+#define DCC_ADDRESS_IDLE		(0xFF)
+#define DCC_ADDRESS_BROADCAST	(0x00)
+
+#define DCC_HEAP_NONE (0xFFFF)
+
+/* Maximum number of addresses tracked at once, also the number of speed and function packets
+   so every address that's tracked can always be refreshed */
+#ifndef DCC_ADDRESS_INFO_MAX
+#define DCC_ADDRESS_INFO_MAX (128)
+#endif
+
+/* Address statistics index before address has been looked up, and once table is full */
+#define DCC_STATS_NONE		(0xFF)
+#define DCC_STATS_UNTRACKED	(0xFE)
+
+#define DCC_PREAMBLE_MAX (20)
+
+/* Function groups F0-F4, F5-F8, F9-F12, then F13-F68 in groups of 8 */
+#define DCC_FUNCTION_GROUPS	(10)
+
+/* Half-bit periods in microseconds */
+#define DCC_PERIOD_ONE	(58)
+#define DCC_PERIOD_ZERO	(100)
+
+/* Priority lanes, highest first.  Packets start in the command lane, or emergency lane for
+   emergency stops, and move to the refresh lane once their initial burst has been sent */
+typedef enum
+{
+	DCC_PRIORITY_EMERGENCY,
+	DCC_PRIORITY_COMMAND,
+	DCC_PRIORITY_REFRESH,
+	DCC_PRIORITY_IDLE,
+	DCC_PRIORITY_COUNT
+} DCC_Priority_t;
 
 typedef struct DCC_AddressInfo
 {
-	struct DCC_AddressInfo *Next;
-	uint8_t Address;
+	OS_ListNode_t Node;	// Node in idle list whilst packet list is empty
+	bool Idle;
+	uint16_t Address;
+	uint16_t HeapIndex;	// Position in scheduler heap, DCC_HEAP_NONE if list is empty
+	uint8_t HeapPriority;	// Priority lane of heap address is in
+	uint8_t StatsIndex;	// Entry in address statistics, DCC_STATS_NONE until first packet is queued
 	Time_t HoldOffTime;	// Earliest time that a packet for this address can be sent
+	Time_t HeapTime;	// Earliest time that head of list can be sent, max(HoldOffTime, List->Time)
+	Time_t ChangeTime;	// Time a new packet was last queued for this address
 	DCC_Packet_t *List;
+	DCC_Packet_t *Active;	// Packet taken from list for transmission, address is held out of heap until it completes
+	DCC_SpeedPacket_t *SpeedPacket;	// Speed packet for address, updated in place by new speed commands
+	DCC_FunctionPacket_t *FunctionPacket;	// Sends changed function groups and refreshes the rest
+	uint16_t FunctionChanged;	// Function groups changed since they were last sent
+	uint8_t FunctionState[DCC_FUNCTION_GROUPS];	// Data bits for each function group, 0 is the default state
 } DCC_AddressInfo_t;
 
 
@@ -32,11 +92,16 @@ public:
 	DCC_Packet_t(uint16_t Address);
 	virtual ~DCC_Packet_t();
 	
-	virtual bool Schedule(uint32_t &Time) { return true; }
-	virtual bool IsSame(const DCC_Packet_t *Packet) { return false; }
+	virtual bool Schedule(uint32_t &) { return true; }
+	virtual bool IsSame(const DCC_Packet_t *) { return false; }
 	virtual void PacketStart(void) { return; }
-	virtual uint16_t DataEnd(void) { return 0; }
+	virtual uint16_t Gap(void) { return 0; }	// Time track is held low after end bit in microseconds
+	virtual void DataEnd(void) { return; }
 	virtual void PacketEnd(void) { return; }
+	virtual bool EmergencyStop(void) { return false; }	// Return true if packet should be discarded on emergency stop
+	
+	/* Called when scheduler has finished with the packet */
+	virtual void Release(void) { delete this; }
 	
 	DCC_Packet_t *Next;
 	
@@ -44,6 +109,8 @@ public:
 	DCC_AddressInfo_t *AddressInfo;
 	
 	Time_t Time;
+	Time_t StartTime;	// Time packet last started being sent
+	DCC_Priority_t Priority;
 
 	uint8_t Size;
 	uint8_t Data[6];
@@ -52,6 +119,7 @@ public:
 	OS_SignalSet_t Signal;
 
 	uint8_t PreambleBits;
+	uint16_t Duration;	// Time taken to send packet in microseconds, set when compiled for transmission
 	
 	enum
 	{
@@ -64,52 +132,96 @@ public:
 	bool Cancelled;
 	
 	void Init(const uint8_t *Data, uint8_t Size, uint8_t PreambleBits, OS_SignalSet_t Signal);
+	
+	/* Number of bytes used by address at start of packet */
+	uint8_t AddressSize(void) const { return (Address & DCC_ADDRESS_LONG) ? 2 : 1; }
+	
+	static uint16_t LocoAddress(uint16_t Loco);
+	
+protected:
+	uint8_t InitAddress(uint8_t *Packet) const;
 };
 
 
 class DCC_SpeedPacket_t : public DCC_Packet_t
 {
 public:
-	DCC_SpeedPacket_t(uint8_t Address, uint8_t Speed, uint8_t Forward);
+	DCC_PACKET_POOLED
+	DCC_SpeedPacket_t(DCC_AddressInfo_t *AddressInfo, uint8_t Steps);
+	virtual ~DCC_SpeedPacket_t();
 	virtual bool Schedule(uint32_t &Time);
 	virtual bool IsSame(const DCC_Packet_t *Packet);
 	virtual void PacketStart(void);
 	virtual void PacketEnd(void);
+	virtual bool EmergencyStop(void) { return true; }
+	
+	/* Rewrite packet with new speed and restart its initial burst.  Transmit stream is compiled
+	   from the data when packet is prefetched, so data can be rewritten whilst packet is active.
+	   Speed is in 128 step form, 0 is stop, 1 is emergency stop, and is scaled to speed step mode */
+	void Update(uint8_t Speed, uint8_t Forward);
+	
+	/* Rewrite packet after speed step mode, or FL in 14 step mode, has changed */
+	void SetSteps(uint8_t Steps) { this->Steps = Steps; Update(Speed, Forward); }
+	uint8_t GetSteps(void) const { return Steps; }
+	uint8_t GetSpeed(void) const { return Speed; }
+	uint8_t GetForward(void) const { return Forward; }
 protected:
 	uint8_t TxCount;
 	uint32_t Scheduled;
 	bool Repeat;
+	uint8_t Steps;
+	uint8_t Speed;
+	uint8_t Forward;
 };
 
 
 
+/* One function packet per address, it sends each changed group as a burst of commands then
+   refreshes groups that aren't in their default state in rotation.  Packet is freed once
+   all groups are back in their default state */
 class DCC_FunctionPacket_t : public DCC_Packet_t
 {
 public:
-	DCC_FunctionPacket_t(uint8_t Address, uint8_t Functions, uint8_t StartFunction = 0);
+	DCC_PACKET_POOLED
+	DCC_FunctionPacket_t(DCC_AddressInfo_t *AddressInfo);
+	virtual ~DCC_FunctionPacket_t();
 	virtual bool Schedule(uint32_t &Time);
-	virtual bool IsSame(const DCC_Packet_t *Packet);
 	virtual void PacketStart(void);
 	virtual void PacketEnd(void);
 protected:
-	uint8_t TxCount;
+	void Encode(uint8_t Group);
+	uint8_t Group;		// Function group in packet data
+	uint8_t BurstCount;	// Remaining repeats of changed group
 	uint32_t Scheduled;
-	uint8_t Mask;
 };
 
-class DCC_FunctionExpansionPacket_t : public DCC_Packet_t
+
+class DCC_BinaryStatePacket_t : public DCC_Packet_t
 {
 public:
-	DCC_FunctionExpansionPacket_t(uint8_t Address, uint8_t Functions, uint8_t StartFunction);
+	DCC_PACKET_POOLED
+	DCC_BinaryStatePacket_t(uint16_t Address, uint16_t State, bool On);
 	virtual bool Schedule(uint32_t &Time);
 	virtual bool IsSame(const DCC_Packet_t *Packet);
 protected:
 	uint8_t TxCount;
-	uint32_t Scheduled;
-	uint8_t Mask;
 };
 
 
+/* Sets consist address in CV19 of decoder, consist address 0 removes decoder from consist */
+class DCC_ConsistControlPacket_t : public DCC_Packet_t
+{
+public:
+	DCC_PACKET_POOLED
+	DCC_ConsistControlPacket_t(uint16_t Address, uint8_t Consist, bool Reversed);
+	virtual bool Schedule(uint32_t &Time);
+	virtual bool IsSame(const DCC_Packet_t *Packet);
+protected:
+	uint8_t TxCount;
+};
+
+
+/* Only one idle packet exists, it's statically allocated and reset when released */
 class DCC_IdlePacket_t : public DCC_Packet_t
 {
 public:
@@ -117,15 +229,26 @@ public:
 	virtual bool Schedule(uint32_t &Time);
 	virtual void PacketStart(void);
 	virtual void PacketEnd(void);
+	virtual void Release(void);
 protected:
 	bool Scheduled;
 };
 
 
+/* Broadcast emergency stop, never scheduled, the DCC Tx state machine sends it in place of
+   the scheduled packet whilst an emergency stop is in progress */
+class DCC_EmergencyStopPacket_t : public DCC_Packet_t
+{
+public:
+	DCC_EmergencyStopPacket_t(void);
+};
+
+
 
 class DCC_ServicePacket_t : public DCC_Packet_t
 {
 public:
+	DCC_PACKET_POOLED
 	DCC_ServicePacket_t(const uint8_t *Data, uint8_t DataSize, OS_SignalSet_t Signal);
 	virtual bool Schedule(uint32_t &Time);
 protected:
@@ -133,13 +256,32 @@ protected:
 };
 
 
+/* Operations mode CV write, sent to a decoder on the main track.  Packets are queued by the
+   scheduler and sent one at a time, paced so they don't hold up other traffic */
+class DCC_CvMainWritePacket_t : public DCC_Packet_t
+{
+public:
+	DCC_PACKET_POOLED
+	DCC_CvMainWritePacket_t(uint16_t Address, uint16_t CvId, uint8_t Value);
+	DCC_CvMainWritePacket_t(uint16_t Address, uint16_t CvId, uint8_t Bit, bool Value);
+	virtual bool Schedule(uint32_t &Time);
+	virtual void Release(void);
+protected:
+	void Encode(uint16_t CvId, uint8_t Operation, uint8_t Value);
+	uint8_t TxCount;
+	Time_t Scheduled;
+	Time_t NextTime;	// Earliest time packet can be sent again
+};
+
+
 class DCC_CvWritePacket_t : public DCC_Packet_t
 {
 public:
+	DCC_PACKET_POOLED
 	DCC_CvWritePacket_t(uint16_t CvId, uint8_t Value, bool *ResultPtr, OS_SignalSet_t Signal);
 	virtual bool Schedule(uint32_t &Time);
 	virtual void PacketStart(void);
-	virtual uint16_t DataEnd(void);
+	virtual uint16_t Gap(void);
 	virtual void PacketEnd(void);
 protected:
 	uint8_t TxCount;
@@ -149,14 +291,83 @@ protected:
 class DCC_CvReadPacket_t : public DCC_Packet_t
 {
 public:
+	DCC_PACKET_POOLED
 	DCC_CvReadPacket_t(uint16_t CvId, uint8_t *ResultPtr, OS_SignalSet_t Signal);
 	virtual bool Schedule(uint32_t &Time);
 	virtual void PacketStart(void);
-	virtual uint16_t DataEnd(void);
+	virtual uint16_t Gap(void);
+	virtual void DataEnd(void);
 	virtual void PacketEnd(void);
 protected:
 	uint8_t TxCount;
 	uint8_t *ValuePtr;
 };
 
+
+/* Reads a batch of CVs without leaving service mode.  Each CV is read a bit at a time then
+   confirmed with a byte verify, bits are only re-read if confirmation fails */
+class DCC_CvReadBatchPacket_t : public DCC_Packet_t
+{
+public:
+	DCC_PACKET_POOLED
+	DCC_CvReadBatchPacket_t(DCC_CvReadBatch_t *Batch, OS_SignalSet_t Signal);
+	virtual bool Schedule(uint32_t &Time);
+	virtual void PacketStart(void);
+	virtual uint16_t Gap(void);
+	virtual void PacketEnd(void);
+	virtual void Release(void);
+protected:
+	void Result(bool Acked);
+	void Encode(void);
+	DCC_CvReadBatch_t *Batch;
+	enum
+	{
+		RESET,
+		BIT,
+		VERIFY,
+	} Phase;
+	uint8_t TxCount;	// Packets sent for reset or current bit
+	uint8_t Bit;
+	uint8_t Value;
+	bool Retry;			// Bits are being re-read after failed confirmation
+	volatile bool Sent;
+	volatile bool Acked;
+};
+
+
+/* Refresh classes, moving locomotives are refreshed in preference to background state such
+   as functions and stationary locomotives when the track is busy */
+typedef enum
+{
+	DCC_REFRESH_MOVING,
+	DCC_REFRESH_BACKGROUND,
+} DCC_RefreshClass_t;
+
+/* Get period until packet is next refreshed, Base is the period when the track is lightly loaded */
+Time_t DCC_RefreshPeriod(const DCC_Packet_t *Packet, Time_t Base, DCC_RefreshClass_t Class);
+
+
+/* Called when batch CV read has finished, so idle packets are sent again */
+void DCC_ServiceModeComplete(void);
+
+/* Called when operations mode packet is released, so next queued one can be sent */
+void DCC_PomComplete(const DCC_Packet_t *Packet);
+
+
+/* Prepare transmitter, called before DCC timer is started */
+void DCC_TxInit(void);
+
+/* Compile packet into transmit bit stream and make it the next packet to send once
+   Time is reached, no other packet must be scheduled */
+void DCC_TxSchedule(DCC_Packet_t *Packet, Time_t Time);
+
+/* Take back scheduled packet if it hasn't started, returns NULL if there was none or it has started */
+DCC_Packet_t *DCC_TxUnschedule(void);
+
+/* Take list of packets that have been sent */
+DCC_Packet_t *DCC_TxCompleted(void);
+
+/* Send broadcast emergency stop Count times from the next packet boundary, ahead of any scheduled packet */
+void DCC_TxEmergencyStop(uint8_t Count);
+
 #endif /* DCC_PACKET_H_ */
\ No newline at end of file
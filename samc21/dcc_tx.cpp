@@ -5,6 +5,8 @@
  *  Author: jonso
  */ 
 
+#include <cstring>
+
 #include <sam.h>
 #include "os.h"
 #include "pio.h"
@@ -14,309 +16,547 @@
 #include "debug.h"
 #include "ac.h"
 #include "dcc_packet.h"
+#include "dmac.h"
 
 
 typedef enum
 {
-	DCC_STATE_IDLE_1,
-	DCC_STATE_IDLE_2,
+	DCC_STATE_IDLE,
+	DCC_STATE_ACTIVE,
+} DCC_State_t;
 
-	DCC_STATE_PREAMBLE_1,
-	DCC_STATE_PREAMBLE_2,
-	
-	DCC_STATE_PAYLOAD_START_1,
-	DCC_STATE_PAYLOAD_START_2,
-	DCC_STATE_PAYLOAD_START_3,
-	DCC_STATE_PAYLOAD_START_4,
-
-	DCC_STATE_PAYLOAD_BIT0_1,
-	DCC_STATE_PAYLOAD_BIT0_2,
-	DCC_STATE_PAYLOAD_BIT0_3,
-	DCC_STATE_PAYLOAD_BIT0_4,
-
-	DCC_STATE_PAYLOAD_BIT1_1,
-	DCC_STATE_PAYLOAD_BIT1_2,
-	
-	DCC_STATE_PAYLOAD_END_1,
-	DCC_STATE_PAYLOAD_END_2,
 
-	DCC_STATE_GAP,
+static DCC_State_t DCC_State;
 
-	DCC_STATE_COMPLETE_1,
-	DCC_STATE_COMPLETE_2,
-} DCC_State_t;
+/* Level of next half-bit whilst not sending a packet, continuous one bits are sent */
+static bool DCC_TxHigh;
 
+/* Packet being generated */
+static DCC_Packet_t *DCC_TxPacket;
 
-volatile static DCC_State_t DCC_State;
+/* Packets that have been sent, waiting for DCC task to re-schedule them */
+static DCC_Packet_t *DCC_TxCompleteList;
 
-bool DCC_TxIsComplete(void)
-{
-	return DCC_State >= DCC_STATE_COMPLETE_1;
-}
+/* Packet to send next, once its time is reached */
+static DCC_Packet_t *DCC_ScheduledPacket;
+static Time_t DCC_ScheduledPacketTime;
+extern volatile uint32_t DCC_TimerTime;
+
+
+/* Packets are compiled into a stream of half-bits before being sent, each entry has
+   the pattern level in the top bit and the TCC0 period in microseconds for the half-bit
+   in the remaining bits.  Any gap after the end bit is a single low entry. */
+#define DCC_STREAM_LEVEL	(0x8000)
+#define DCC_STREAM_PERIOD	(0x7FFF)
+
+/* Preamble, start bit and 8 data bits per byte, end bit and gap */
+#define DCC_STREAM_SIZE		(2 * (DCC_PREAMBLE_MAX + 9 * sizeof(DCC_Packet_t::Data) + 1) + 1)
 
-bool DCC_TxIsIdle(void)
+typedef struct
 {
-	return DCC_State <= DCC_STATE_IDLE_2;
+	uint16_t Entry[DCC_STREAM_SIZE];
+	const uint16_t *DataEnd;
+	const uint16_t *End;
+} DCC_Stream_t;
+
+/* One stream for the packet being generated and one for the scheduled packet */
+static DCC_Stream_t DCC_Streams[2];
+static DCC_Stream_t *DCC_TxStream = &DCC_Streams[0];
+static DCC_Stream_t *DCC_ScheduledStream;
+
+static const uint16_t *DCC_StreamPtr;
+
+/* Broadcast emergency stop is compiled at init and sent in place of the scheduled packet whilst
+   DCC_TxEStopCount is non-zero, time from request to first bit on track is recorded */
+static DCC_EmergencyStopPacket_t DCC_EStopPacket;
+static DCC_Stream_t DCC_EStopStream;
+static uint8_t DCC_TxEStopCount;
+static bool DCC_TxEStopRequested;
+static Time_t DCC_TxEStopRequestTime;
+
+/* Broadcast is addressed to every decoder, so no packet starts until 5ms after the end of
+   an emergency stop, including the next repeat */
+static bool DCC_TxEStopHoldOff;
+static Time_t DCC_TxEStopHoldOffTime;
+static uint32_t DCC_TxEStopLatency;
+static uint32_t DCC_TxEStopLatencyMax;
+
+
+static uint16_t *DCC_StreamBit(uint16_t *Stream, bool One)
+{
+	const uint16_t Period = One ? DCC_PERIOD_ONE : DCC_PERIOD_ZERO;
+	*Stream++ = Period;
+	*Stream++ = Period | DCC_STREAM_LEVEL;
+	return Stream;
 }
 
-void DCC_TxIdle(void)
+static void DCC_StreamCompile(DCC_Stream_t *Compiled, DCC_Packet_t *Packet)
 {
-	OS_InterruptDisable();
-	PanicFalse(DCC_TxIsComplete());
-	DCC_State = (DCC_State == DCC_STATE_COMPLETE_1) ? DCC_STATE_IDLE_1 : DCC_STATE_IDLE_2;
-	OS_InterruptEnable();
+	uint16_t *Stream = Compiled->Entry;
+	
+	for (uint8_t Bit = 0; Bit < Packet->PreambleBits; Bit++)
+		Stream = DCC_StreamBit(Stream, true);
+
+	for (uint8_t Index = 0; Index < Packet->Size; Index++)
+	{
+		/* Start bit followed by data bits, MSB first */
+		uint8_t Byte = Packet->Data[Index];
+		Stream = DCC_StreamBit(Stream, false);
+		for (uint8_t Bit = 0; Bit < 8; Bit++, Byte <<= 1)
+			Stream = DCC_StreamBit(Stream, Byte & 0x80);
+	}
+
+	/* End bit */
+	Stream = DCC_StreamBit(Stream, true);
+	Compiled->DataEnd = Stream;
+	
+	/* Optional gap with track held low, e.g. for service mode acknowledgment */
+	uint16_t Gap = Packet->Gap();
+	if (Gap)
+	{
+		PanicFalse(Gap <= DCC_STREAM_PERIOD);
+		*Stream++ = Gap;
+	}
+	Compiled->End = Stream;
+	
+	/* Total time on track, used to measure track utilisation */
+	uint16_t Duration = 0;
+	for (const uint16_t *Entry = Compiled->Entry; Entry < Stream; Entry++)
+		Duration += *Entry & DCC_STREAM_PERIOD;
+	Packet->Duration = Duration;
 }
 
-static uint8_t  DCC_PreambleCount;
-static uint8_t  DCC_EndCount;
 
-static uint8_t DCC_PayloadIndex;
-static uint8_t DCC_PayloadByte;
-static uint8_t DCC_PayloadBitsLeft;
 
-extern DCC_Packet_t *DCC_TxPacket;
-extern DCC_Packet_t *DCC_ScheduledPacket;
-extern volatile uint32_t DCC_ScheduledPacketTime;
-extern volatile uint32_t DCC_TimerTime;
+/* Events raised whilst generating the waveform.  When generating from the TCC0 interrupt
+   they're handled immediately, in DMA mode they're queued with the buffer half and handled
+   once the half has been sent */
+typedef enum
+{
+	DCC_TX_EVENT_START,
+	DCC_TX_EVENT_DATA_END,
+	DCC_TX_EVENT_END,
+} DCC_TxEventType_t;
 
-static const uint16_t StatePattern[] =
+typedef struct
 {
-	TCC_PATT_PGV0, //	DCC_STATE_IDLE_1
-	TCC_PATT_PGV1, //	DCC_STATE_IDLE_2
+	DCC_TxEventType_t Type;
+	DCC_Packet_t *Packet;
+	Time_t Time;
+} DCC_TxEvent_t;
 
-	TCC_PATT_PGV0, //	DCC_STATE_PREAMBLE_1
-	TCC_PATT_PGV1, //	DCC_STATE_PREAMBLE_2
+
+void DCC_TxSchedule(DCC_Packet_t *Packet, Time_t Time)
+{
+	PanicFalse(DCC_ScheduledPacket == NULL);
+	PanicFalse(Packet->State == DCC_Packet_t::SCHEDULED);
+
+	/* Tx state machine won't touch the other stream until scheduled packet is set */
+	DCC_Stream_t *Stream = (DCC_TxStream == &DCC_Streams[0]) ? &DCC_Streams[1] : &DCC_Streams[0];
+	DCC_StreamCompile(Stream, Packet);
 	
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_START_1
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_START_2
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_START_3
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_START_4
+	OS_InterruptDisable();
+	DCC_ScheduledStream = Stream;
+	DCC_ScheduledPacketTime = Time;
+	DCC_ScheduledPacket = Packet;
+	OS_InterruptEnable();
+}
 
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_BIT0_1
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_BIT0_2
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_BIT0_3
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_BIT0_4
 
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_BIT1_1
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_BIT1_2
+DCC_Packet_t *DCC_TxUnschedule(void)
+{
+	OS_InterruptDisable();
+	DCC_Packet_t *Packet = DCC_ScheduledPacket;
+	DCC_ScheduledPacket = NULL;
+	OS_InterruptEnable();
+	return Packet;
+}
 
-	TCC_PATT_PGV0, //	DCC_STATE_PAYLOAD_END_1
-	TCC_PATT_PGV1, //	DCC_STATE_PAYLOAD_END_2
 
-	TCC_PATT_PGV0, //	DCC_STATE_GAP
+DCC_Packet_t *DCC_TxCompleted(void)
+{
+	OS_InterruptDisable();
+	DCC_Packet_t *List = DCC_TxCompleteList;
+	DCC_TxCompleteList = NULL;
+	OS_InterruptEnable();
+	return List;
+}
 
-	TCC_PATT_PGV0, //	DCC_STATE_COMPLETE_1
-	TCC_PATT_PGV1, //	DCC_STATE_COMPLETE_2
-};
 
+void DCC_TxInit(void)
+{
+	/* Compiled before the timer starts, so stream is never read whilst being written */
+	DCC_StreamCompile(&DCC_EStopStream, &DCC_EStopPacket);
+}
 
 
+void DCC_TxEmergencyStop(uint8_t Count)
+{
+	/* DCC time lags the track by up to a DMA half, clock is exact */
+	const Time_t Now = Time_Now();
+	
+	OS_InterruptDisable();
+	DCC_TxEStopCount = Count;
+	DCC_TxEStopRequested = true;
+	DCC_TxEStopRequestTime = Now;
+	OS_InterruptEnable();
+}
 
 
-static void DCC_GetNextByte(void)
+void DCC_GetEmergencyStopLatency(uint32_t *Latency, uint32_t *LatencyMax)
 {
-	PanicNull(DCC_TxPacket);
-	if (DCC_PayloadIndex < DCC_TxPacket->Size)
-	{
-		DCC_PayloadByte = DCC_TxPacket->Data[DCC_PayloadIndex];
-		DCC_PayloadIndex += 1;
-		DCC_PayloadBitsLeft = 8;
-		DCC_State = DCC_STATE_PAYLOAD_START_1;
-	}
-	else
-	{
-		DCC_State = DCC_STATE_PAYLOAD_END_1;
-	}
+	OS_InterruptDisable();
+	*Latency = DCC_TxEStopLatency;
+	*LatencyMax = DCC_TxEStopLatencyMax;
+	OS_InterruptEnable();
 }
 
-static void DCC_GetNextBit(void)
+
+static void DCC_TxEventHandle(const DCC_TxEvent_t *Event)
 {
-	if (DCC_PayloadBitsLeft)
+	DCC_Packet_t *Packet = Event->Packet;
+	switch (Event->Type)
 	{
-		DCC_PayloadBitsLeft -= 1;
-		if (DCC_PayloadByte & 0x80)
-			DCC_State = DCC_STATE_PAYLOAD_BIT1_1;
-		else
-			DCC_State = DCC_STATE_PAYLOAD_BIT0_1;
-		DCC_PayloadByte = DCC_PayloadByte << 1;
+		case DCC_TX_EVENT_START:
+		{
+			//if (Packet->Address != 0xFF)
+			//	Debug("PacketStart, %p, state %u\n", Packet, Packet->State);
+			Packet->StartTime = Event->Time;
+			Packet->PacketStart();
+		}
+		break;
+		
+		case DCC_TX_EVENT_DATA_END:
+		{
+			/* Store packet completion time for this address */
+			PanicNull(Packet->AddressInfo);
+			Packet->AddressInfo->HoldOffTime = Time_Add(Event->Time, 5000);
+			Packet->DataEnd();
+		}
+		break;
+		
+		case DCC_TX_EVENT_END:
+		{
+			//if (Packet->Address != 0xFF)
+			//	Debug("PacketEnd, %p, state %u\n", Packet, Packet->State);
+			Packet->State = DCC_Packet_t::COMPLETE;
+			Packet->PacketEnd();
+			
+			/* Pass back to DCC task */
+			Packet->Next = DCC_TxCompleteList;
+			DCC_TxCompleteList = Packet;
+			OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+		}
+		break;
 	}
-	else
-		DCC_GetNextByte();
 }
 
-static void DCC_PacketStart(DCC_Packet_t *Packet)
-{
-	PanicNull(Packet);
-
-	//if (Packet->Address != 0xFF)
-	//	Debug("PacketStart, %p, state %u\n", Packet, Packet->State);
-	
-	PanicFalse(Packet->State == DCC_Packet_t::SCHEDULED);
-	Packet->State = DCC_Packet_t::ACTIVE;
-	
-	DCC_TxPacket = Packet;
-	DCC_TxPacket->PacketStart();
 
-	DCC_State = DCC_STATE_PREAMBLE_1;	
-	DCC_PreambleCount = DCC_TxPacket->PreambleBits;
-	DCC_EndCount = 1;
-	DCC_PayloadIndex = 0;	
-}
+#if DCC_TX_DMA
 
+/* Number of half-bits in each half of the DMA ring, interrupt rate is reduced by this
+   factor but events such as packet end are only handled once their half has been sent */
+#define DCC_TX_DMA_HALF_BITS	(16)
 
+/* Enough for data end and end of one packet and start of the next */
+#define DCC_TX_DMA_EVENTS	(4)
 
-static void DCC_PacketEnd(void)
+typedef struct
+{
+	uint16_t Pattern[DCC_TX_DMA_HALF_BITS];
+	uint32_t Period[DCC_TX_DMA_HALF_BITS];
+	uint32_t Duration;
+	uint8_t NumEvents;
+	DCC_TxEvent_t Event[DCC_TX_DMA_EVENTS];
+} DCC_TxDmaHalf_t;
+
+static DCC_TxDmaHalf_t DCC_TxDmaRing[2];
+static DCC_TxDmaHalf_t *DCC_TxDmaFill;
+
+/* Pattern and period are written by separate channels both triggered by TCC0 overflow.  For
+   each channel the base descriptor sends first half and links to second descriptor, which
+   sends second half and links back */
+static DMAC_Descriptor_t DCC_TxDmaPatternDescriptor __attribute((aligned (16)));
+static DMAC_Descriptor_t DCC_TxDmaPeriodDescriptor __attribute((aligned (16)));
+static uint8_t DCC_TxDmaChannel;
+static uint8_t DCC_TxDmaPeriodChannel;
+static uint8_t DCC_TxDmaNext;
+
+/* Time that the next half-bit to be generated will be sent */
+static Time_t DCC_TxDmaTime;
+
+static void DCC_TxEvent(DCC_TxEventType_t Type, Time_t Time)
 {
-	PanicNull(DCC_TxPacket);
+	/* Emergency stop isn't a scheduled packet so has no events */
+	if (DCC_TxPacket == NULL)
+		return;
+	
+	PanicFalse(DCC_TxDmaFill->NumEvents < DCC_TX_DMA_EVENTS);
+	DCC_TxEvent_t *Event = &DCC_TxDmaFill->Event[DCC_TxDmaFill->NumEvents++];
+	Event->Type = Type;
+	Event->Packet = DCC_TxPacket;
+	Event->Time = Time;
+}
 
-	//if (DCC_TxPacket->Address != 0xFF)
-	//	Debug("PacketEnd, %p, state %u\n", DCC_TxPacket, DCC_TxPacket->State);
+#else
 
-	PanicFalse(DCC_TxPacket->State == DCC_Packet_t::ACTIVE);
-	DCC_TxPacket->State = DCC_Packet_t::COMPLETE;
+/* Events are raised as the half-bit they're timed from is buffered, so they're held until
+   the half-bit has been sent.  Otherwise PacketEnd() would be called as an acknowledgment
+   gap starts rather than when it ends */
+#define DCC_TX_EVENTS_PENDING	(4)
 
-	DCC_TxPacket->PacketEnd();
+static DCC_TxEvent_t DCC_TxEventPending[DCC_TX_EVENTS_PENDING];
+static uint8_t DCC_TxEventCount;
+
+static void DCC_TxEvent(DCC_TxEventType_t Type, Time_t Time)
+{
+	/* Emergency stop isn't a scheduled packet so has no events */
+	if (DCC_TxPacket == NULL)
+		return;
 	
-	DCC_State = DCC_STATE_COMPLETE_1;
-	OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+	PanicFalse(DCC_TxEventCount < DCC_TX_EVENTS_PENDING);
+	DCC_TxEvent_t *Event = &DCC_TxEventPending[DCC_TxEventCount++];
+	Event->Type = Type;
+	Event->Packet = DCC_TxPacket;
+	Event->Time = Time;
 }
 
+/* Handle pending events that are due by Time, they're raised in time order */
+static void DCC_TxEventDispatch(Time_t Time)
+{
+	uint8_t Index = 0;
+	while ((Index < DCC_TxEventCount) && Time_Ge(Time, DCC_TxEventPending[Index].Time))
+		DCC_TxEventHandle(&DCC_TxEventPending[Index++]);
+	
+	if (Index)
+	{
+		DCC_TxEventCount -= Index;
+		memmove(DCC_TxEventPending, &DCC_TxEventPending[Index], DCC_TxEventCount * sizeof(DCC_TxEvent_t));
+	}
+}
 
+#endif
 
 
-
-
-void TCC0_Handler(void)  __attribute__((__interrupt__));
-void TCC0_Handler(void)
+/* Start scheduled packet if it's due by Time, when its first half-bit would be sent */
+static void DCC_TxStart(Time_t Time)
 {
-	uint16_t TccPattern = StatePattern[DCC_State] | TCC_PATT_PGE0 | TCC_PATT_PGE1;
-	switch (DCC_State)
+	if (DCC_TxEStopHoldOff)
 	{
-		case DCC_STATE_IDLE_1:
+		if (Time_Lt(Time, DCC_TxEStopHoldOffTime))
+			return;
+		DCC_TxEStopHoldOff = false;
+	}
+	
+	if (DCC_TxEStopCount)
+	{
+		/* Send emergency stop ahead of scheduled packet, which stays scheduled */
+		DCC_TxEStopCount -= 1;
+		if (DCC_TxEStopRequested)
 		{
-			/* No packet ready yet, move to other idle state */
-			DCC_State = DCC_STATE_IDLE_2;
+			DCC_TxEStopRequested = false;
+			DCC_TxEStopLatency = Time_Sub(Time, DCC_TxEStopRequestTime);
+			if (DCC_TxEStopLatency > DCC_TxEStopLatencyMax)
+				DCC_TxEStopLatencyMax = DCC_TxEStopLatency;
 		}
-		break;
-
-		case DCC_STATE_IDLE_2:
-		{			
-			if (DCC_ScheduledPacket && Time_Le(DCC_ScheduledPacketTime, DCC_TimerTime))
-			{
-				DCC_PacketStart(DCC_ScheduledPacket);
-				break;
-			}
-
-			/* Move to other idle state */
-			DCC_State = DCC_STATE_IDLE_1;
-		}
-		break;
 		
-		case DCC_STATE_PREAMBLE_1:
-			DCC_State = DCC_STATE_PREAMBLE_2;
-			break;
-		
-		case DCC_STATE_PREAMBLE_2:
-			DCC_PreambleCount -= 1;
-			if (DCC_PreambleCount == 0)
-				DCC_GetNextByte();
-			else
-				DCC_State = DCC_STATE_PREAMBLE_1;
-			break;
-		
-		case DCC_STATE_PAYLOAD_START_1:
-			DCC_State = DCC_STATE_PAYLOAD_START_2;
-			break;
-		case DCC_STATE_PAYLOAD_START_2:
-			DCC_State = DCC_STATE_PAYLOAD_START_3;
-			break;
-		case DCC_STATE_PAYLOAD_START_3:
-			DCC_State = DCC_STATE_PAYLOAD_START_4;
-			break;
-		case DCC_STATE_PAYLOAD_START_4:
-			DCC_GetNextBit();
-			break;
-		
-		case DCC_STATE_PAYLOAD_BIT0_1:
-			DCC_State = DCC_STATE_PAYLOAD_BIT0_2;
-			break;
-		case DCC_STATE_PAYLOAD_BIT0_2:
-			DCC_State = DCC_STATE_PAYLOAD_BIT0_3;
-			break;
-		case DCC_STATE_PAYLOAD_BIT0_3:
-			DCC_State = DCC_STATE_PAYLOAD_BIT0_4;
-			break;
-		case DCC_STATE_PAYLOAD_BIT0_4:
-			DCC_GetNextBit();
-			break;
+		DCC_TxPacket = NULL;
+		DCC_TxStream = &DCC_EStopStream;
+		DCC_State = DCC_STATE_ACTIVE;
+		DCC_StreamPtr = DCC_TxStream->Entry;
+	}
+	else if (DCC_ScheduledPacket && Time_Le(DCC_ScheduledPacketTime, Time))
+	{
+		DCC_TxPacket = DCC_ScheduledPacket;
+		DCC_TxPacket->State = DCC_Packet_t::ACTIVE;
+		DCC_TxStream = DCC_ScheduledStream;
+		DCC_ScheduledPacket = NULL;
 		
-		case DCC_STATE_PAYLOAD_BIT1_1:
-			DCC_State = DCC_STATE_PAYLOAD_BIT1_2;
-			break;
-		case DCC_STATE_PAYLOAD_BIT1_2:
-			DCC_GetNextBit();
-			break;
-
-		case DCC_STATE_PAYLOAD_END_1:
-			DCC_State = DCC_STATE_PAYLOAD_END_2;
-			break;
+		DCC_State = DCC_STATE_ACTIVE;
+		DCC_StreamPtr = DCC_TxStream->Entry;
+		DCC_TxEvent(DCC_TX_EVENT_START, Time);
 		
-		case DCC_STATE_PAYLOAD_END_2:
+		/* Wake DCC task so it can schedule the next packet */
+		OS_SignalSend(DCC_TASK_ID, OS_SIGNAL_USER);
+	}
+}
+
+
+/* Generate next half-bit, returns stream entry with its level and period.  Time is when it will be sent */
+static uint16_t DCC_TxGenerate(Time_t Time)
+{
+	uint16_t Entry;
+	if (DCC_State == DCC_STATE_ACTIVE)
+	{
+		/* Send current half-bit and move to next entry, events are timed from end of the half-bit */
+		Entry = *DCC_StreamPtr++;
+		const Time_t EndTime = Time_Add(Time, Entry & DCC_STREAM_PERIOD);
+		if (DCC_StreamPtr == DCC_TxStream->DataEnd)
 		{
-			DCC_EndCount -= 1;
-			if (DCC_EndCount == 0)
-			{
-				/* Store packet completion time for this address */
-				PanicNull(DCC_TxPacket->AddressInfo);
-				DCC_TxPacket->AddressInfo->HoldOffTime = Time_Add(DCC_TimerTime, 5000);
-
-				DCC_EndCount = DCC_TxPacket->DataEnd();
-				if (DCC_EndCount)
-					DCC_State = DCC_STATE_GAP;
-				else
-					DCC_PacketEnd();
-			}
-			else
+			DCC_TxEvent(DCC_TX_EVENT_DATA_END, EndTime);
+			if (DCC_TxPacket == NULL)
 			{
-				DCC_State = DCC_STATE_PAYLOAD_END_1;
+				DCC_TxEStopHoldOff = true;
+				DCC_TxEStopHoldOffTime = Time_Add(EndTime, 5000);
 			}
 		}
-		break;
-		
-		case DCC_STATE_GAP:
-		{
-			DCC_EndCount -= 1;
-			if (DCC_EndCount == 0)
-				DCC_PacketEnd();
-		}
-		break;
-		
-		case DCC_STATE_COMPLETE_1:
+		if (DCC_StreamPtr == DCC_TxStream->End)
 		{
-			DCC_State = DCC_STATE_COMPLETE_2;
+			DCC_State = DCC_STATE_IDLE;
+			DCC_TxHigh = false;
+			DCC_TxEvent(DCC_TX_EVENT_END, EndTime);
+			
+			/* Chain straight into next packet if packet ended with the end bit rather than a gap */
+			if (Entry & DCC_STREAM_LEVEL)
+				DCC_TxStart(EndTime);
 		}
-		break;
+	}
+	else
+	{
+		/* No packet being sent, send one bits.  Only start packet after second half of a bit */
+		Entry = DCC_TxHigh ? (DCC_PERIOD_ONE | DCC_STREAM_LEVEL) : DCC_PERIOD_ONE;
+		if (DCC_TxHigh)
+			DCC_TxStart(Time_Add(Time, DCC_PERIOD_ONE));
+		DCC_TxHigh = !DCC_TxHigh;
+	}
+	
+	return Entry;
+}
 
-		case DCC_STATE_COMPLETE_2:
-		{
-			DCC_State = DCC_STATE_COMPLETE_1;
-		}
-		break;
-		
+
+static inline uint16_t DCC_TxPattern(uint16_t Entry)
+{
+	if (Entry & DCC_STREAM_LEVEL)
+		return TCC_PATT_PGV1 | TCC_PATT_PGE0 | TCC_PATT_PGE1;
+	else
+		return TCC_PATT_PGV0 | TCC_PATT_PGE0 | TCC_PATT_PGE1;
+}
+
+
+#if DCC_TX_DMA
+
+static void DCC_TxDmaRefill(DCC_TxDmaHalf_t *Half)
+{
+	DCC_TxDmaFill = Half;
+	Half->NumEvents = 0;
+	Half->Duration = 0;
+	for (uint8_t Index = 0; Index < DCC_TX_DMA_HALF_BITS; Index++)
+	{
+		const uint16_t Entry = DCC_TxGenerate(DCC_TxDmaTime);
+		const uint16_t Period = Entry & DCC_STREAM_PERIOD;
+		Half->Pattern[Index] = DCC_TxPattern(Entry);
+		Half->Period[Index] = Period - 1;		// TCC0 counts from zero to PER
+		Half->Duration += Period;
+		DCC_TxDmaTime = Time_Add(DCC_TxDmaTime, Period);
 	}
+}
+
+static void DCC_TxDmaInterruptHandler(void *, const uint8_t DmaChannel, const uint16_t)
+{
+	uint8_t ChannelId = DMAC->CHID.reg;
+	DMAC->CHID.reg = DmaChannel;
+	const uint8_t IntStatus = DMAC->CHINTFLAG.reg;
+	DMAC->CHINTFLAG.reg = IntStatus;
+	DMAC->CHID.reg = ChannelId;
 	
-	while (TCC0->SYNCBUSY.reg & TCC_SYNCBUSY_PATT) {}
-	TCC0->PATTBUF.reg = TccPattern;
+	if (IntStatus & DMAC_CHINTFLAG_TERR)
+		Panic();
+	
+	if (IntStatus & DMAC_CHINTFLAG_TCMPL)
+	{
+		/* Half has been sent, handle its events and advance clock */
+		DCC_TxDmaHalf_t *Half = &DCC_TxDmaRing[DCC_TxDmaNext];
+		for (uint8_t Index = 0; Index < Half->NumEvents; Index++)
+			DCC_TxEventHandle(&Half->Event[Index]);
+		DCC_TimerTime += Half->Duration;
+		
+		/* Fill half again whilst other half is being sent */
+		DCC_TxDmaRefill(Half);
+		DCC_TxDmaNext ^= 1;
+	}
+}
 
-	/* Clear OVF interrupt */
-	TCC0->INTFLAG.reg = TCC_INTFLAG_OVF;
+static void DCC_TxDmaChannelInit(uint8_t Channel, uint8_t Level, DMAC_Descriptor_t *Second, uint16_t BeatSize, uint32_t BlockAction,
+								 const void *First, const void *SecondSrc, volatile void *Dst)
+{
+	DMAC_Descriptor_t *DmaDesc = DMAC_ChannelGetBaseDescriptor(Channel);
+	DmaDesc->BTCTRL.reg = BeatSize | DMAC_BTCTRL_SRCINC | BlockAction | DMAC_BTCTRL_VALID;
+	DmaDesc->BTCNT.reg = DCC_TX_DMA_HALF_BITS;
+	DmaDesc->SRCADDR.reg = DMAC_Address(First);
+	DmaDesc->DSTADDR.reg = DMAC_Address(Dst);
+	DmaDesc->DESCADDR.reg = DMAC_Address(Second);
+
+	Second->BTCTRL.reg = DmaDesc->BTCTRL.reg;
+	Second->BTCNT.reg = DCC_TX_DMA_HALF_BITS;
+	Second->SRCADDR.reg = DMAC_Address(SecondSrc);
+	Second->DSTADDR.reg = DMAC_Address(Dst);
+	Second->DESCADDR.reg = DMAC_Address(DmaDesc);
+	
+	/* Reset channel */
+	DMAC->CHID.reg = Channel;
+	DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
 
-	/* Advance clock */
-	DCC_TimerTime += 58;	
+	/* Transfer one beat on each TCC0 overflow */
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(Level) | DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_TRIGSRC(TCC0_DMAC_ID_OVF);
 }
 
+void DCC_TxDmaInit(void)
+{
+	DCC_TxDmaTime = DCC_TimerTime;
+	DCC_TxDmaRefill(&DCC_TxDmaRing[0]);
+	DCC_TxDmaRefill(&DCC_TxDmaRing[1]);
+	DCC_TxDmaNext = 0;
+	
+	DCC_TxDmaChannel = DMAC_ChannelAllocate(DCC_TxDmaInterruptHandler, NULL, DMAC_NO_CHANNEL);
+	PanicFalse(DCC_TxDmaChannel != DMAC_NO_CHANNEL);
+	DCC_TxDmaPeriodChannel = DMAC_ChannelAllocate(NULL, NULL, DMAC_NO_CHANNEL);
+	PanicFalse(DCC_TxDmaPeriodChannel != DMAC_NO_CHANNEL);
+
+	/* Source addresses are end of each half as source address is incremented.  Period
+	   channel has higher priority so its half is always finished before the pattern
+	   channel interrupts and the half is refilled */
+	DCC_TxDmaChannelInit(DCC_TxDmaPeriodChannel, 1, &DCC_TxDmaPeriodDescriptor,
+						 DMAC_BTCTRL_BEATSIZE_WORD, DMAC_BTCTRL_BLOCKACT_NOACT,
+						 &DCC_TxDmaRing[0].Period[DCC_TX_DMA_HALF_BITS],
+						 &DCC_TxDmaRing[1].Period[DCC_TX_DMA_HALF_BITS], &TCC0->PERBUF.reg);
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+
+	/* Only pattern channel interrupts, once each half has been sent */
+	DCC_TxDmaChannelInit(DCC_TxDmaChannel, 0, &DCC_TxDmaPatternDescriptor,
+						 DMAC_BTCTRL_BEATSIZE_HWORD, DMAC_BTCTRL_BLOCKACT_INT,
+						 &DCC_TxDmaRing[0].Pattern[DCC_TX_DMA_HALF_BITS],
+						 &DCC_TxDmaRing[1].Pattern[DCC_TX_DMA_HALF_BITS], &TCC0->PATTBUF.reg);
+	DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+}
 
+#else
 
+/* Period of half-bit currently being sent and of half-bit in the buffers, pattern and period
+   written in the interrupt are buffered and take effect from the next overflow */
+static uint16_t DCC_TxPeriod = DCC_PERIOD_ONE;
+static uint16_t DCC_TxBufferedPeriod = DCC_PERIOD_ONE;
 
+void TCC0_Handler(void)  __attribute__((__interrupt__));
+void TCC0_Handler(void)
+{
+	/* Advance clock to start of half-bit that has just started, which was buffered last time */
+	DCC_TimerTime += DCC_TxPeriod;
+	DCC_TxPeriod = DCC_TxBufferedPeriod;
+	
+	/* Generate half-bit that follows it */
+	const uint16_t Entry = DCC_TxGenerate(Time_Add(DCC_TimerTime, DCC_TxPeriod));
+	DCC_TxBufferedPeriod = Entry & DCC_STREAM_PERIOD;
+	
+	while (TCC0->SYNCBUSY.reg & TCC_SYNCBUSY_PATT) {}
+	TCC0->PATTBUF.reg = DCC_TxPattern(Entry);
+	TCC0->PERBUF.reg = DCC_TxBufferedPeriod - 1;
 
+	/* Clear OVF interrupt */
+	TCC0->INTFLAG.reg = TCC_INTFLAG_OVF;
+	
+	DCC_TxEventDispatch(DCC_TimerTime);
+}
 
+#endif
@@ -56,8 +56,8 @@ void DMAC_Init(void)
 	DMAC->CTRL.bit.SWRST = 1;
 
 	/* Set BASEADDR & WRBADDR */
-	DMAC->BASEADDR.reg = (uint32_t)DMAC_DescriptorArray;
-	DMAC->WRBADDR.reg  = (uint32_t)DMAC_WriteBackDescriptorArray;
+	DMAC->BASEADDR.reg = DMAC_Address(DMAC_DescriptorArray);
+	DMAC->WRBADDR.reg  = DMAC_Address(DMAC_WriteBackDescriptorArray);
 
 	/* DMA continues when CPU is halted by external debugger */
 	//DMAC->DBGCTRL.reg = DMAC_DBGCTRL_DBGRUN;
@@ -109,13 +109,13 @@ void DMAC_ChannelFree(uint8_t Channel)
 
 DMAC_Descriptor_t *DMAC_ChannelGetBaseDescriptor(uint8_t Channel)
 {
-	DMAC_Descriptor_t *DescriptorArray = (DMAC_Descriptor_t *)DMAC->BASEADDR.reg;
+	DMAC_Descriptor_t *DescriptorArray = (DMAC_Descriptor_t *)(uintptr_t)DMAC->BASEADDR.reg;
 	return &DescriptorArray[Channel];
 }
 
 DMAC_Descriptor_t *DMAC_ChannelGetWriteBackDescriptor(uint8_t Channel)
 {
-	DMAC_Descriptor_t *DescriptorArray = (DMAC_Descriptor_t *)DMAC->WRBADDR.reg;
+	DMAC_Descriptor_t *DescriptorArray = (DMAC_Descriptor_t *)(uintptr_t)DMAC->WRBADDR.reg;
 	return &DescriptorArray[Channel];
 }
 
@@ -28,6 +28,12 @@ typedef struct DMAC_Descriptor_t DMAC_Descriptor_t;
 
 #define DMAC_NO_CHANNEL	(0xFF)
 
+/* Address as written to descriptor and DMAC address registers, which are 32 bits wide */
+static inline uint32_t DMAC_Address(volatile const void *Ptr)
+{
+	return (uint32_t)(uintptr_t)Ptr;
+}
+
 extern void DMAC_Init(void);
 extern uint8_t DMAC_ChannelAllocate(void (*InterruptHandler)(void *, const uint8_t, const uint16_t), void *InterruptData, uint8_t RequestedChannel);
 extern void DMAC_ChannelFree(uint8_t Channel);
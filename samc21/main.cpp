@@ -21,6 +21,8 @@
 #include "esp.h"
 #include "sercom.h"
 #include "ac.h"
+#include "cs.h"
+#include "rtime.h"
 #include "dcc_msg.h"
 
 #define ENABLE_ESP
@@ -56,7 +58,7 @@ PB01 -
 PB02 - 
 PB03
 PB04 - 
-PB05 - Current Sensor AC/AIN6
+PB05 - Current Sensor AC/AIN6, ADC1/AIN7
 PB06 - 
 PB07 - 
 PB08 - 
@@ -71,8 +73,6 @@ PB31 - ESP2 SERCOM5
 
 extern void CLI_Init(void);
 extern void CLI_InputChar(uint8_t Char);
-extern uint32_t CLI_GetLocoFunctions(uint8_t Loco);
-extern void CLI_SetLocoFunctions(uint8_t Loco, uint32_t Functions);
 
 
 #define MAIN_SIGNAL_TIMER		(1 << (OS_SIGNAL_USER + 0))
@@ -85,6 +85,8 @@ ESP_t ESP[2];
 
 void MAIN_Task(void *Instance)
 {
+	Time64_t TickTime = Time_Now();
+	
 	for (;;)
 	{
 		OS_SignalSet_t Sig = OS_SignalWait(0xFFFFUL);
@@ -92,9 +94,16 @@ void MAIN_Task(void *Instance)
 		if (Sig & MAIN_SIGNAL_TIMER)
 		{
 #ifdef ENABLE_ESP
-			ESP_TimerTick(&ESP[0]);
+			/* Timer signals don't queue, so run ESP timers once for each millisecond that has
+			   passed rather than once per signal */
+			const Time64_t Now = Time_Now();
+			while (Now - TickTime >= 1000)
+			{
+				TickTime += 1000;
+				ESP_TimerTick(&ESP[0]);
+				ESP_TimerTick(&ESP[1]);
+			}
 			ESP_Task(&ESP[0]);
-			ESP_TimerTick(&ESP[1]);
 			ESP_Task(&ESP[1]);
 #endif			
 		}
@@ -113,6 +122,31 @@ void CALLBACK_ESP_LinkReset(ESP_t *Esp)
 }
 
 
+/* Report overcurrent faults to both controllers */
+void CALLBACK_DCC_TrackFault(bool Fault)
+{
+#ifdef ENABLE_ESP
+	for (uint8_t Index = 0; Index < 2; Index++)
+	{
+		if (!ESP_IsSynced(&ESP[Index]))
+			continue;
+
+		DCC_TrackFault_t *Msg = MEM_Create(DCC_TrackFault_t);
+		if (Msg)
+		{
+			Msg->Id = DCC_TRACK_FAULT;
+			Msg->Fault = Fault;
+			ESP_Packet_t *Packet = ESP_CreatePacket(1, Msg, sizeof(DCC_TrackFault_t), false);
+			if (Packet)
+				ESP_TxPacket(&ESP[Index], Packet);
+			else
+				MEM_Free(Msg);
+		}
+	}
+#endif
+}
+
+
 void CALLBACK_ESP_PacketReceived(ESP_t *Esp, uint8_t *Msg, uint8_t MsgSize)
 {
 	const uint8_t Id = Msg[0];
@@ -137,7 +171,10 @@ void CALLBACK_ESP_PacketReceived(ESP_t *Esp, uint8_t *Msg, uint8_t MsgSize)
 		case DCC_STOP_LOCO:
 		{
 			DCC_StopLoco_t *Stop = (DCC_StopLoco_t *)Msg;
-			DCC_StopLocomotive(Stop->Address, Stop->Forward);
+			if (Stop->Address == DCC_STOP_ALL)
+				DCC_EmergencyStop();
+			else
+				DCC_StopLocomotive(Stop->Address, Stop->Forward);
 			if (ESP_IsSynced(Esp))
 			{
 				ESP_Packet_t *Packet = ESP_CreatePacket(1, Msg, sizeof(DCC_StopLoco_t), false);
@@ -154,25 +191,7 @@ void CALLBACK_ESP_PacketReceived(ESP_t *Esp, uint8_t *Msg, uint8_t MsgSize)
 		{
 			DCC_SetLocoFunction_t *Func = (DCC_SetLocoFunction_t *)Msg;
 
-			uint32_t Functions = CLI_GetLocoFunctions(Func->Address);
-			if (Func->Set)
-				Functions |= 1UL << Func->Function;
-			else
-				Functions &= ~(1UL << Func->Function);				
-			CLI_SetLocoFunctions(Func->Address, Functions);
-			
-			if (Func->Function <= 4)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 1) & 0b01111) | ((Functions & 0b00001) << 4), 0); /* F1 - F4 */
-			else if (Func->Function <= 8)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 5) & 0b01111), 5); /* F5 - F8 */
-			else if (Func->Function <= 12)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 9) & 0b01111), 9); /* F9 - F12 */
-			else if (Func->Function <= 20)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 13) & 0b1111111), 13); /* F13 - F20 */
-			else if (Func->Function <= 28)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 21) & 0b1111111), 21); /* F21 - F28 */
-			else if (Func->Function <= 36)
-				DCC_SetLocomotiveFunctions(Func->Address, ((Functions >> 29) & 0b1111111), 29); /* F29 - F36 */
+			DCC_SetLocomotiveFunction(Func->Address, Func->Function, Func->Set);
 
 			if (ESP_IsSynced(Esp))
 			{
@@ -208,6 +227,9 @@ int main(void)
 	/* Initialise memory pools */
 	MEM_Init();
 
+	/* Start microsecond clock, everything else timestamps from it */
+	Time_Init();
+
 	/* Initialise DMA controller */
 	DMAC_Init();
 
@@ -244,6 +266,7 @@ int main(void)
 	DCC_Init(DCC_MODE_NORMAL);
 
 	AC_Init();
+	CS_Init();
 
 			
 	CLI_Init();
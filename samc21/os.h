@@ -48,7 +48,8 @@ __inline static void OS_InterruptEnable(void)
 }
 
 
-typedef struct OS_ListNode
+/* List header is also accessed as a node, at Head and at Tail, so node accesses may alias it */
+typedef struct __attribute__((may_alias)) OS_ListNode
 {
 	struct OS_ListNode *Succ;
 	struct OS_ListNode *Pred;
@@ -0,0 +1,65 @@
+/*
+ * rtime.c
+ *
+ * Created: 18/10/2026 10:12:37
+ *  Author: jonso
+ */ 
+
+#include <sam.h>
+#include <stdint.h>
+
+#include "os.h"
+#include "clk.h"
+#include "rtime.h"
+
+/* Upper 32 bits of clock, counted by TC0 overflow interrupt */
+static volatile uint32_t Time_High;
+
+
+void TC0_Handler(void) __attribute__ ((__interrupt__));
+void TC0_Handler(void)
+{
+	TC0->COUNT32.INTFLAG.reg = TC_INTFLAG_OVF;
+	Time_High += 1;
+}
+
+
+Time64_t Time_Now(void)
+{
+	OS_InterruptDisable();
+
+	TC0->COUNT32.CTRLBSET.reg = TC_CTRLBSET_CMD_READSYNC;
+	while (TC0->COUNT32.SYNCBUSY.reg & (TC_SYNCBUSY_CTRLB | TC_SYNCBUSY_COUNT));
+	const uint32_t Low = TC0->COUNT32.COUNT.reg;
+	uint32_t High = Time_High;
+
+	/* Overflow not handled yet, either interrupts are disabled or called from a higher
+	   priority interrupt.  Only applies if count was read after overflow */
+	if ((TC0->COUNT32.INTFLAG.reg & TC_INTFLAG_OVF) && (Low < 0x80000000UL))
+		High += 1;
+
+	OS_InterruptEnable();
+	return ((Time64_t)High << 32) | Low;
+}
+
+
+void Time_Init(void)
+{
+	/* Enable TC0 and TC1 Bus clocks, TC1 is slave to TC0 in 32-bit mode */
+	MCLK->APBCMASK.reg |= MCLK_APBCMASK_TC0 | MCLK_APBCMASK_TC1;
+
+	/* Drive TC0 from 8MHz GCLK2, counts in microseconds after prescaler.  Faster clock than
+	   1MHz GCLK1 keeps read synchronisation in Time_Now() short */
+	CLK_EnablePeripheral(2, TC0_GCLK_ID);
+
+	TC0->COUNT32.CTRLA.reg = TC_CTRLA_SWRST;
+	while (TC0->COUNT32.SYNCBUSY.bit.SWRST);
+	TC0->COUNT32.CTRLA.reg = TC_CTRLA_MODE_COUNT32 | TC_CTRLA_PRESCALER_DIV8;
+	TC0->COUNT32.INTENSET.reg = TC_INTENSET_OVF;
+
+	NVIC_SetPriority(TC0_IRQn, 3);
+	NVIC_EnableIRQ(TC0_IRQn);
+
+	TC0->COUNT32.CTRLA.reg |= TC_CTRLA_ENABLE;
+	while (TC0->COUNT32.SYNCBUSY.bit.ENABLE);
+}
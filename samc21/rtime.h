@@ -1,10 +1,15 @@
 #ifndef __RTIME_H__
 #define __RTIME_H__
 
+#include <stdint.h>
+
 typedef uint32_t Time_t;
 
+/* Microseconds since clock service started, never wraps */
+typedef uint64_t Time64_t;
+
 #define	Time_Add(t1, t2)	((t1) + (t2))
-#define	Time_Sub(t1, t2)	((int32_t) (t1) - (int32_t) (t2))
+#define	Time_Sub(t1, t2)	((int32_t) ((Time_t) (t1) - (Time_t) (t2)))
 #define	Time_Eq(t1, t2)		((t1) == (t2))
 #define	Time_Ne(t1, t2)		((t1) != (t2))
 #define Time_Gt(t1, t2)		(Time_Sub((t1), (t2)) > 0)
@@ -12,4 +17,17 @@ typedef uint32_t Time_t;
 #define Time_Lt(t1, t2)		(Time_Sub((t1), (t2)) < 0)
 #define Time_Le(t1, t2)		(Time_Sub((t1), (t2)) <= 0)
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Free running microsecond clock on TC0/TC1, the low 32 bits are the same time base as Time_t
+   so Time_Now() can be compared with DCC times */
+void Time_Init(void);
+Time64_t Time_Now(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif	/* __RTIME_H__ */
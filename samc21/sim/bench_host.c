@@ -0,0 +1,62 @@
+/*
+ * bench_host.c
+ *
+ * Created: 18/10/2026 15:31:20
+ *  Author: jonso
+ *
+ * Host side of the kernels in bench.c: timer, heap for the pool allocator and the ESP
+ * services that the SLIP encoder and receiver call.
+ */
+
+#include <time.h>
+
+#include "mem.h"
+#include "esp.h"
+#include "bench.h"
+
+/* Stands in for RAM after the _end linker symbol, see bench_mem.c */
+uint8_t Bench_PoolHeap[BENCH_POOL_HEAP_SIZE] __attribute__((aligned(8)));
+
+const char Bench_TimerUnit[] = "ns";
+
+
+uint32_t Bench_TimerStart(void)
+{
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (uint32_t)((uint64_t)Now.tv_sec * 1000000000ULL + Now.tv_nsec);
+}
+
+uint32_t Bench_TimerStop(uint32_t Start)
+{
+	return Bench_TimerStart() - Start;
+}
+
+
+void ESP_HwTxKick(ESP_t *Esp)
+{
+	(void)Esp;
+}
+
+void ESP_SyncRxPacket(ESP_t *Esp, uint8_t Packet)
+{
+	(void)Esp;
+	(void)Packet;
+}
+
+void ESP_DestroyPacket(ESP_Packet_t *Packet)
+{
+	if (Packet)
+	{
+		if (Packet->Type == ESP_PACKET_TYPE_PAYLOAD_DYNAMIC && Packet->Data)
+			MEM_Free(Packet->Data);
+		MEM_Free(Packet);
+	}
+}
+
+void CALLBACK_ESP_PacketReceived(ESP_t *Esp, uint8_t *Packet, uint8_t PacketSize)
+{
+	(void)Esp;
+	(void)PacketSize;
+	MEM_Free(Packet);
+}
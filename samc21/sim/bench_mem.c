@@ -0,0 +1,22 @@
+/*
+ * bench_mem.c
+ *
+ * Created: 18/10/2026 15:36:57
+ *  Author: jonso
+ *
+ * Pool allocator from mem.c built under other names for the host benchmark, as the engine
+ * uses the simulator's heap backed MEM_Alloc().  Pools are carved from Bench_PoolHeap in
+ * place of RAM after the _end linker symbol.
+ */
+
+#define MEM_Init		Bench_PoolInit
+#define MEM_Alloc		Bench_PoolAlloc
+#define MEM_Free		Bench_PoolFree
+#define MEM_Pool		Bench_Pool
+#define MEM_BlockClear	Bench_PoolBlockClear
+
+#define _end			Bench_PoolHeap
+#define HSRAM_ADDR		((uintptr_t)&_end)
+#define HSRAM_SIZE		BENCH_POOL_HEAP_SIZE
+
+#include "mem.c"
@@ -0,0 +1,146 @@
+/*
+ * dcc_bench.cpp
+ *
+ * Created: 18/10/2026 15:30:44
+ *  Author: jonso
+ *
+ * Host benchmark, runs the kernels in bench.c and times the scheduler with 10 to 1000
+ * addresses.  Engine is built into this file so its static scheduling functions can be
+ * called directly.  One line of JSON per result on stdout.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../dcc.cpp"
+#include "bench.h"
+#include "sim.h"
+
+/* Addresses given speed commands for each scheduler run, only DCC_ADDRESS_INFO_MAX are held */
+static const uint16_t Bench_DccAddresses[] = { 10, 30, 100, 300, 1000 };
+
+/* Track time taken by each packet, about that of a speed packet */
+#define BENCH_DCC_PACKET_TIME	DCC_MS(5)
+
+extern "C" void Bench_PoolInit(void);
+
+
+/*
+ * Scheduler
+ */
+
+/* Give each locomotive a speed, as the DCC task would for a speed request.  Requests for
+   addresses past DCC_ADDRESS_INFO_MAX are refused */
+static void Bench_DccFill(uint16_t Count)
+{
+	OS_ListInit(&DCC_AddressIdleList);
+	OS_ListInit(&DCC_AddressFreeList);
+
+	Bench_Result_t Result;
+	Bench_Begin(&Result, "dcc_speed_new", Count, 1);
+	for (uint16_t Loco = 1; Loco <= Count; Loco++)
+	{
+		DCC_SendRequest_t Request;
+		Request.Type = DCC_SEND_SPEED;
+		Request.Loco = Loco;
+		Request.Value = 1 + (Loco % 126);
+		Request.Param = 1;
+
+		const uint32_t Start = Bench_TimerStart();
+		DCC_UpdateSpeed(&Request);
+		Bench_Sample(&Result, Bench_TimerStop(Start));
+	}
+	Bench_Report(&Result);
+	printf("{\"kernel\":\"dcc_addresses\",\"param\":%u,\"held\":%u}\n", Count, DCC_AddressInfoCount);
+}
+
+
+static void Bench_DccEmpty(void)
+{
+	for (uint16_t Index = 0; Index < DCC_ADDRESS_TABLE_SIZE; Index++)
+	{
+		DCC_AddressInfo_t *AddressInfo = DCC_AddressTable[Index];
+		if (AddressInfo == NULL)
+			continue;
+
+		DCC_Packet_t *Packet;
+		while ((Packet = AddressInfo->List) != NULL)
+		{
+			AddressInfo->List = Packet->Next;
+			Packet->Release();
+		}
+		DCC_AddressTable[Index] = NULL;
+	}
+
+	memset(DCC_AddressHeap, 0, sizeof(DCC_AddressHeap));
+	DCC_AddressInfoCount = 0;
+	DCC_AddressInfoUnused = 0;
+}
+
+
+/* Send packets as the DCC task and Tx state machine would, without compiling them, timing
+   choice of next packet and insertion of each packet as it's re-scheduled */
+static void Bench_DccScheduler(uint16_t Count)
+{
+	Bench_DccFill(Count);
+
+	Bench_Result_t Next, Insert;
+	Bench_Begin(&Next, "dcc_next_packet", Count, 1);
+	Bench_Begin(&Insert, "dcc_insert_packet", Count, 1);
+
+	for (uint16_t Sample = 0; Sample < BENCH_SAMPLES; Sample++)
+	{
+		Time_t TxTime;
+		uint32_t Start = Bench_TimerStart();
+		DCC_Packet_t *Packet = DCC_NextPacket(TxTime);
+		Bench_Sample(&Next, Bench_TimerStop(Start));
+		PanicNull(Packet);
+
+		/* Take packet from its list whilst it's sent */
+		DCC_AddressInfo_t *AddressInfo = Packet->AddressInfo;
+		AddressInfo->List = Packet->Next;
+		AddressInfo->Active = Packet;
+		DCC_UpdateAddressInfo(AddressInfo);
+
+		/* Clock moves on to the end of the packet, waiting for it first if it isn't due */
+		const int32_t Wait = Time_Sub(TxTime, DCC_Now());
+		Sim_Advance((Wait > 0) ? Wait + BENCH_DCC_PACKET_TIME : BENCH_DCC_PACKET_TIME);
+		Time_t Time = DCC_Now();
+		AddressInfo->HoldOffTime = Time_Add(Time, 5000);
+		AddressInfo->Active = NULL;
+
+		/* Speed packets always want to be sent again */
+		PanicFalse(Packet->Schedule(Time));
+		Packet->Time = Time;
+		Packet->State = DCC_Packet_t::SCHEDULED;
+
+		Start = Bench_TimerStart();
+		PanicFalse(DCC_InsertPacket(Packet));
+		Bench_Sample(&Insert, Bench_TimerStop(Start));
+	}
+
+	Bench_Report(&Next);
+	Bench_Report(&Insert);
+	Bench_DccEmpty();
+}
+
+
+static void Bench_PrintF(const char *Format, ...)
+{
+	va_list ArgList;
+	va_start(ArgList, Format);
+	vprintf(Format, ArgList);
+	va_end(ArgList);
+}
+
+
+int main(void)
+{
+	Bench_PoolInit();
+	Bench_Init(Bench_PrintF);
+	Bench_Run();
+
+	for (uint8_t Run = 0; Run < sizeof(Bench_DccAddresses) / sizeof(Bench_DccAddresses[0]); Run++)
+		Bench_DccScheduler(Bench_DccAddresses[Run]);
+	return 0;
+}
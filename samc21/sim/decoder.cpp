@@ -0,0 +1,315 @@
+/*
+ * decoder.cpp
+ *
+ * Created: 18/10/2026 14:05:26
+ *  Author: jonso
+ *
+ * Decoder model, levels output by TCC0 are joined into half-bits, pairs of half-bits into
+ * bits and bits into packets as a decoder on the track would see them.  Half-bits are
+ * checked against transmitter limits rather than the wider limits a decoder accepts.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+/* Widest half-bits that a decoder accepts, NMRA S-9.1 */
+#define SIM_DECODE_ONE_MIN		(52)
+#define SIM_DECODE_ONE_MAX		(64)
+#define SIM_DECODE_ZERO_MIN		(90)
+
+/* Fewest preamble bits a decoder needs before a start bit */
+#define SIM_DECODE_PREAMBLE		(10)
+
+typedef enum
+{
+	SIM_HALF_ONE,
+	SIM_HALF_ZERO,
+	SIM_HALF_GAP,
+	SIM_HALF_INVALID,
+} Sim_HalfBit_t;
+
+typedef enum
+{
+	SIM_STATE_PREAMBLE,
+	SIM_STATE_DATA,
+	SIM_STATE_SEPARATOR,
+} Sim_DecoderState_t;
+
+static Sim_PacketHandler_t Sim_PacketHandler;
+static bool Sim_CheckHoldOff;
+static Sim_DecoderStats_t Sim_Stats;
+
+/* Level currently on track and when it started */
+static bool Sim_Level;
+static bool Sim_LevelValid;
+static Time64_t Sim_LevelStart;
+
+/* First (low) half of bit being received, and whether it started straight after an end bit */
+static bool Sim_LowValid;
+static bool Sim_LowAfterEnd;
+static uint32_t Sim_LowPeriod;
+
+static Sim_DecoderState_t Sim_State;
+static uint8_t Sim_Ones;
+static uint8_t Sim_BitCount;
+static uint8_t Sim_Byte;
+static Sim_Packet_t Sim_Packet;
+
+/* Whether last thing received was an end bit, a gap is only allowed there */
+static bool Sim_PacketEnded;
+
+/* End of last packet to each multi-function address */
+static Time64_t Sim_LastEnd[SIM_ADDRESS_MAX + 1];
+
+/* End of last broadcast, which is addressed to every decoder */
+static Time64_t Sim_BroadcastEnd;
+
+
+uint16_t Sim_PacketAddress(const Sim_Packet_t *Packet)
+{
+	const uint8_t First = Packet->Data[0];
+	if (First >= 1 && First <= 127)
+		return First;
+	else if (First >= 0xC0 && First <= 0xE7 && Packet->Size > 2)
+		return ((First & 0x3F) << 8) | Packet->Data[1];
+	else
+		return 0;
+}
+
+
+static void Sim_DecoderReset(void)
+{
+	Sim_State = SIM_STATE_PREAMBLE;
+	Sim_Ones = 0;
+	Sim_LowValid = false;
+}
+
+
+static void Sim_DecoderPacket(void)
+{
+	uint8_t Check = 0;
+	for (uint8_t Index = 0; Index < Sim_Packet.Size; Index++)
+		Check ^= Sim_Packet.Data[Index];
+
+	Sim_Stats.Packets += 1;
+	if (Check)
+	{
+		Sim_Stats.ChecksumErrors += 1;
+		return;
+	}
+	if (Sim_Packet.Preamble < SIM_PREAMBLE_MIN)
+		Sim_Stats.PreambleErrors += 1;
+
+	const uint16_t Address = Sim_PacketAddress(&Sim_Packet);
+	const bool Broadcast = (Sim_Packet.Data[0] == 0x00);
+	if (Sim_CheckHoldOff && (Address || Broadcast))
+	{
+		if (Sim_BroadcastEnd && (Sim_Packet.Start - Sim_BroadcastEnd < SIM_HOLDOFF_MIN))
+			Sim_Stats.HoldOffErrors += 1;
+		else if (Address && Sim_LastEnd[Address] && (Sim_Packet.Start - Sim_LastEnd[Address] < SIM_HOLDOFF_MIN))
+			Sim_Stats.HoldOffErrors += 1;
+		
+		if (Broadcast)
+			Sim_BroadcastEnd = Sim_Packet.End;
+		else
+			Sim_LastEnd[Address] = Sim_Packet.End;
+	}
+
+	if (Sim_PacketHandler)
+		Sim_PacketHandler(&Sim_Packet);
+}
+
+
+static void Sim_DecoderBit(bool One, Time64_t Start, Time64_t End)
+{
+	Sim_PacketEnded = false;
+	switch (Sim_State)
+	{
+		case SIM_STATE_PREAMBLE:
+			if (One)
+			{
+				if (Sim_Ones < 0xFF)
+					Sim_Ones += 1;
+			}
+			else if (Sim_Ones >= SIM_DECODE_PREAMBLE)
+			{
+				Sim_Packet.Start = Start;
+				Sim_Packet.Preamble = Sim_Ones;
+				Sim_Packet.Size = 0;
+				Sim_State = SIM_STATE_DATA;
+				Sim_BitCount = 0;
+			}
+			else
+				Sim_Ones = 0;
+			break;
+
+		case SIM_STATE_DATA:
+			Sim_Byte = (Sim_Byte << 1) | One;
+			if (++Sim_BitCount == 8)
+			{
+				Sim_Packet.Data[Sim_Packet.Size++] = Sim_Byte;
+				Sim_State = SIM_STATE_SEPARATOR;
+			}
+			break;
+
+		case SIM_STATE_SEPARATOR:
+			if (One)
+			{
+				/* End bit, it can also be first bit of next preamble */
+				Sim_Packet.End = End;
+				Sim_DecoderPacket();
+				Sim_PacketEnded = true;
+				Sim_State = SIM_STATE_PREAMBLE;
+				Sim_Ones = 1;
+			}
+			else if (Sim_Packet.Size == SIM_PACKET_MAX)
+			{
+				Sim_Stats.FramingErrors += 1;
+				Sim_DecoderReset();
+			}
+			else
+			{
+				Sim_State = SIM_STATE_DATA;
+				Sim_BitCount = 0;
+			}
+			break;
+	}
+}
+
+
+static Sim_HalfBit_t Sim_DecoderClassify(uint32_t Period)
+{
+	if (Period >= SIM_DECODE_ONE_MIN && Period <= SIM_DECODE_ONE_MAX)
+	{
+		if (Period < SIM_ONE_MIN || Period > SIM_ONE_MAX)
+			Sim_Stats.TimingErrors += 1;
+		if (!Sim_Stats.OneMin || Period < Sim_Stats.OneMin)
+			Sim_Stats.OneMin = Period;
+		if (Period > Sim_Stats.OneMax)
+			Sim_Stats.OneMax = Period;
+		return SIM_HALF_ONE;
+	}
+	else if (Period >= SIM_DECODE_ZERO_MIN && Period <= SIM_ZERO_MAX)
+	{
+		if (Period < SIM_ZERO_MIN)
+			Sim_Stats.TimingErrors += 1;
+		if (!Sim_Stats.ZeroMin || Period < Sim_Stats.ZeroMin)
+			Sim_Stats.ZeroMin = Period;
+		if (Period > Sim_Stats.ZeroMax)
+			Sim_Stats.ZeroMax = Period;
+		return SIM_HALF_ZERO;
+	}
+	else if (Period > SIM_ZERO_MAX)
+		return SIM_HALF_GAP;
+	else
+		return SIM_HALF_INVALID;
+}
+
+
+/* Each bit is sent as a low half followed by a high half of the same length */
+static void Sim_DecoderHalfBit(bool High, uint32_t Period, Time64_t Start)
+{
+	if (!High)
+	{
+		/* Low level after an end bit can be a gap, e.g. for service mode acknowledgment,
+		   it runs into the low half of the next bit so that bit is lost */
+		const bool AfterEnd = Sim_PacketEnded;
+		Sim_PacketEnded = false;
+		if (Period > SIM_ZERO_MAX)
+		{
+			if (AfterEnd)
+				Sim_Stats.Gaps += 1;
+			else
+				Sim_Stats.FramingErrors += 1;
+			Sim_DecoderReset();
+		}
+		else if (Period < SIM_DECODE_ONE_MIN || (Period > SIM_DECODE_ONE_MAX && Period < SIM_DECODE_ZERO_MIN))
+		{
+			Sim_Stats.FramingErrors += 1;
+			Sim_DecoderReset();
+		}
+		else
+		{
+			Sim_LowValid = true;
+			Sim_LowAfterEnd = AfterEnd;
+			Sim_LowPeriod = Period;
+		}
+		return;
+	}
+
+	const Sim_HalfBit_t Half = Sim_DecoderClassify(Period);
+	if (!Sim_LowValid)
+		return;
+	Sim_LowValid = false;
+
+	/* Gap shorter than a stretched zero only shows up as halves that don't match */
+	const Sim_HalfBit_t LowHalf = (Sim_LowPeriod <= SIM_DECODE_ONE_MAX) ? SIM_HALF_ONE : SIM_HALF_ZERO;
+	if ((LowHalf == SIM_HALF_ZERO) && (Half == SIM_HALF_ONE) && Sim_LowAfterEnd)
+	{
+		Sim_Stats.Gaps += 1;
+		Sim_DecoderReset();
+		return;
+	}
+	Sim_DecoderClassify(Sim_LowPeriod);
+	if (Half != LowHalf)
+	{
+		Sim_Stats.FramingErrors += 1;
+		Sim_DecoderReset();
+		return;
+	}
+
+	if (Half == SIM_HALF_ONE)
+	{
+		const uint32_t Skew = (Period > Sim_LowPeriod) ? Period - Sim_LowPeriod : Sim_LowPeriod - Period;
+		if (Skew > SIM_ONE_SKEW_MAX)
+			Sim_Stats.TimingErrors += 1;
+	}
+
+	Sim_DecoderBit(Half == SIM_HALF_ONE, Start - Sim_LowPeriod, Start + Period);
+}
+
+
+void Sim_DecoderInit(Sim_PacketHandler_t Handler, bool CheckHoldOff)
+{
+	Sim_PacketHandler = Handler;
+	Sim_CheckHoldOff = CheckHoldOff;
+	memset(&Sim_Stats, 0, sizeof(Sim_Stats));
+	memset(Sim_LastEnd, 0, sizeof(Sim_LastEnd));
+	Sim_BroadcastEnd = 0;
+	Sim_LevelValid = false;
+	Sim_PacketEnded = false;
+	Sim_DecoderReset();
+}
+
+
+/* Level output for one TCC0 period starting at Time, consecutive periods at the same level
+   make up one half-bit which is complete when the level changes */
+void Sim_DecoderLevel(bool High, uint32_t, Time64_t Time)
+{
+	if (Sim_LevelValid && (High != Sim_Level))
+		Sim_DecoderHalfBit(Sim_Level, Time - Sim_LevelStart, Sim_LevelStart);
+
+	if (!Sim_LevelValid || (High != Sim_Level))
+	{
+		Sim_Level = High;
+		Sim_LevelStart = Time;
+		Sim_LevelValid = true;
+	}
+}
+
+
+/* No signal whilst outputs are blanked, decoder loses framing */
+void Sim_DecoderBlank(uint32_t Period, Time64_t)
+{
+	Sim_Stats.BlankTime += Period;
+	Sim_LevelValid = false;
+	Sim_PacketEnded = false;
+	Sim_DecoderReset();
+}
+
+
+const Sim_DecoderStats_t *Sim_DecoderGetStats(void)
+{
+	return &Sim_Stats;
+}
@@ -0,0 +1,380 @@
+/*
+ * hal.cpp
+ *
+ * Created: 18/10/2026 13:47:33
+ *  Author: jonso
+ *
+ * Hardware and OS stand-ins for the simulator.  The DCC task is the only task, it runs on
+ * the host thread and each time it waits for a signal the rest of the system is stepped
+ * instead: the scenario hook runs as the main task, then TCC0 advances to its next overflow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "os.h"
+#include "debug.h"
+#include "mem.h"
+#include "clk.h"
+#include "dmac.h"
+#include "ac.h"
+#include "sim.h"
+
+static Port Sim_Port;
+static Mclk Sim_Mclk;
+static Tcc Sim_Tcc0;
+static Tc Sim_Tc4;
+static Ac Sim_Ac;
+static Dmac Sim_Dmac;
+
+Port *PORT = &Sim_Port;
+Mclk *MCLK = &Sim_Mclk;
+Tcc *TCC0 = &Sim_Tcc0;
+Tc *TC4 = &Sim_Tc4;
+Ac *AC = &Sim_Ac;
+Dmac *DMAC = &Sim_Dmac;
+
+void TCC0_Handler(void);
+extern "C" DMAC_Descriptor_t DMAC_DescriptorArray[12];
+extern "C" void (*DMAC_InterruptHandler[12])(void *, const uint8_t, const uint16_t);
+extern "C" void *DMAC_InterruptData[12];
+
+#define SIM_DMA_CHANNELS	(12)
+
+bool Sim_Verbose;
+
+/* Virtual time since start of run, and value of clock service at start */
+static Time64_t Sim_Time;
+static Time64_t Sim_Epoch;
+static Time64_t Sim_Duration;
+static Sim_Hook_t Sim_Hook;
+static jmp_buf Sim_Exit;
+
+static bool Sim_Short;
+static uint32_t Sim_TrackFaults;
+
+/* Acknowledgment pulse in progress */
+static bool Sim_AckPending;
+static bool Sim_AckActive;
+static Time64_t Sim_AckStart;
+
+static void (*Sim_DccTask)(void *);
+
+
+/*
+ * OS
+ */
+
+uint8_t OS_InterruptDisableCount;
+OS_Task_t OS_TaskTable[10];
+OS_Task_t *OS_TaskCurrent = &OS_TaskTable[MAIN_TASK_ID];
+
+void OS_TaskInit(OS_TaskId_t TaskId, void (*Handler)(void *), void *, void *, uint32_t)
+{
+	PanicFalse(TaskId == DCC_TASK_ID);
+	Sim_DccTask = Handler;
+}
+
+void OS_SignalSend(OS_TaskId_t TaskId, OS_SignalSet_t SignalMask)
+{
+	OS_TaskTable[TaskId].SignalReceived |= SignalMask;
+}
+
+/* Main task only switches away when send ring is full, it runs nested in the DCC task's wait
+   so the ring can't be emptied.  Scenarios have to send fewer requests per half-bit */
+void OS_Switch(void)
+{
+	PanicMessage(Send ring full);
+}
+
+static void Sim_Overflow(void);
+
+OS_SignalSet_t OS_SignalWait(OS_SignalSet_t SignalMask)
+{
+	/* Only the DCC task can block, scenario runs from the hook and can't wait */
+	PanicFalse(OS_TaskCurrent == &OS_TaskTable[DCC_TASK_ID]);
+	OS_Task_t *Task = OS_TaskCurrent;
+	for (;;)
+	{
+		const OS_SignalSet_t Signal = Task->SignalReceived & SignalMask;
+		if (Signal)
+		{
+			Task->SignalReceived &= ~Signal;
+			return Signal;
+		}
+
+		if (Sim_Time >= Sim_Duration)
+			longjmp(Sim_Exit, 1);
+
+		/* Scenario runs as main task once per half-bit */
+		static Time64_t HookTime = ~0ULL;
+		if (Sim_Hook && (HookTime != Sim_Time))
+		{
+			HookTime = Sim_Time;
+			OS_TaskCurrent = &OS_TaskTable[MAIN_TASK_ID];
+			Sim_Hook(Sim_Time);
+			OS_TaskCurrent = Task;
+			continue;
+		}
+
+		Sim_Overflow();
+	}
+}
+
+
+/*
+ * Debug, memory and other services used by the engine
+ */
+
+/* Engine's own formatter in debug_printf.c is used, output goes to stderr */
+Debug_t DebugState;
+
+void Debug_FormatPutChar(char Char, void *)
+{
+	if (Sim_Verbose)
+		fputc(Char, stderr);
+}
+
+void Debug_PanicFormatPutChar(char Char, void *)
+{
+	fputc(Char, stderr);
+}
+
+void Debug_Panic(const char *Message, const char *File, int Line)
+{
+	fprintf(stderr, "%s at %s:%d, %llu us\n", Message, File, Line, (unsigned long long)Sim_Time);
+	abort();
+}
+
+void CLK_EnablePeripheral(uint8_t, uint8_t)
+{
+}
+
+/* Heap backed, so engine's own limits are exercised rather than target pool sizes */
+void *MEM_Alloc(uint16_t Size)
+{
+	void *Mem = malloc(Size);
+	PanicNull(Mem);
+	return Mem;
+}
+
+void MEM_Free(const void *Mem)
+{
+	free((void *)Mem);
+}
+
+/* Simulator's own containers are larger than a memory block */
+void *operator new(size_t Size)
+{
+	void *Mem = malloc(Size);
+	PanicNull(Mem);
+	return Mem;
+}
+
+void operator delete(void *Ptr) noexcept
+{
+	free(Ptr);
+}
+
+void operator delete(void *Ptr, size_t) noexcept
+{
+	free(Ptr);
+}
+
+Time64_t Time_Now(void)
+{
+	return Sim_Epoch + Sim_Time;
+}
+
+volatile uint16_t CS_Current;
+volatile uint16_t CS_Peak;
+volatile uint32_t CS_BlockCount;
+
+uint32_t AC_TriggeredCount;
+volatile uint16_t AC_PulseWidthMax;
+
+void AC_SetAckThreshold(uint16_t)
+{
+}
+
+void CALLBACK_DCC_TrackFault(bool Fault)
+{
+	if (Fault)
+		Sim_TrackFaults += 1;
+	Debug("Track %s at %lu us\n", Fault ? "fault" : "on", (unsigned long)Sim_Time);
+}
+
+
+/*
+ * Simulated hardware
+ */
+
+/* Decoder on the programming track starts its acknowledgment pulse as soon as it has the packet */
+void Sim_Acknowledge(void)
+{
+	Sim_AckPending = true;
+}
+
+/* Acknowledgment increases current for SIM_ACK_WIDTH, comparator output is high throughout
+   and TC4 captures the width at the falling edge if the trigger is enabled.  Evaluated at
+   each overflow before the engine runs, so a pulse that ended during a long gap has been
+   captured by the time the gap's end event reads it */
+static void Sim_AckUpdate(void)
+{
+	if (Sim_AckPending)
+	{
+		Sim_AckPending = false;
+		Sim_AckActive = true;
+		Sim_AckStart = Sim_Time;
+		if (AC->COMPCTRL[3].bit.ENABLE)
+			AC_TriggeredCount += 1;
+	}
+
+	if (Sim_AckActive)
+	{
+		const Time64_t Width = Sim_Time - Sim_AckStart;
+		if (Width >= SIM_ACK_WIDTH)
+		{
+			Sim_AckActive = false;
+			AC->STATUSA.bit.STATE3 = 0;
+			if (AC->COMPCTRL[3].bit.ENABLE && (SIM_ACK_WIDTH > AC_PulseWidthMax))
+				AC_PulseWidthMax = SIM_ACK_WIDTH;
+		}
+		else
+		{
+			AC->STATUSA.bit.STATE3 = 1;
+			TC4->COUNT16.COUNT.reg = Width;
+		}
+	}
+}
+
+void Sim_SetShort(bool Short)
+{
+	Sim_Short = Short;
+}
+
+uint32_t Sim_GetTrackFaultCount(void)
+{
+	return Sim_TrackFaults;
+}
+
+#if DCC_TX_DMA
+/* Descriptor and beat each channel triggered by TCC0 is on */
+static DMAC_Descriptor_t *Sim_DmaDescriptor[SIM_DMA_CHANNELS];
+static uint16_t Sim_DmaBeat[SIM_DMA_CHANNELS];
+
+/* Channels writing TCC0 buffers are the ones triggered by its overflow, each transfers one
+   beat per trigger and moves on to the linked descriptor at the end of each block */
+static void Sim_DmaTrigger(void)
+{
+	uint16_t Complete = 0;
+	for (uint8_t Channel = 0; Channel < SIM_DMA_CHANNELS; Channel++)
+	{
+		DMAC_Descriptor_t *Desc = Sim_DmaDescriptor[Channel];
+		if (Desc == NULL)
+		{
+			Desc = DMAC_ChannelGetBaseDescriptor(Channel);
+			const uint32_t Dst = Desc->DSTADDR.reg;
+			if (!(Desc->BTCTRL.reg & DMAC_BTCTRL_VALID) ||
+				((Dst != (uint32_t)(uintptr_t)&TCC0->PATTBUF.reg) && (Dst != (uint32_t)(uintptr_t)&TCC0->PERBUF.reg)))
+				continue;
+			Sim_DmaDescriptor[Channel] = Desc;
+		}
+
+		/* Source address is end of block as source is incremented */
+		const uint16_t Beat = Sim_DmaBeat[Channel];
+		if ((Desc->BTCTRL.reg & DMAC_BTCTRL_BEATSIZE_Msk) == DMAC_BTCTRL_BEATSIZE_WORD)
+		{
+			const uint32_t *Src = (const uint32_t *)(uintptr_t)Desc->SRCADDR.reg - Desc->BTCNT.reg;
+			*(volatile uint32_t *)(uintptr_t)Desc->DSTADDR.reg = Src[Beat];
+		}
+		else
+		{
+			const uint16_t *Src = (const uint16_t *)(uintptr_t)Desc->SRCADDR.reg - Desc->BTCNT.reg;
+			*(volatile uint16_t *)(uintptr_t)Desc->DSTADDR.reg = Src[Beat];
+		}
+
+		if (++Sim_DmaBeat[Channel] == Desc->BTCNT.reg)
+		{
+			Sim_DmaBeat[Channel] = 0;
+			Sim_DmaDescriptor[Channel] = (DMAC_Descriptor_t *)(uintptr_t)Desc->DESCADDR.reg;
+			if (Desc->BTCTRL.reg & DMAC_BTCTRL_BLOCKACT_INT)
+				Complete |= 1U << Channel;
+		}
+	}
+
+	/* Interrupts once all beats for this trigger are done */
+	for (uint8_t Channel = 0; Channel < SIM_DMA_CHANNELS; Channel++)
+	{
+		if (Complete & (1U << Channel))
+		{
+			DMAC->CHID.reg = Channel;
+			DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL;
+			DMAC_InterruptHandler[Channel](DMAC_InterruptData[Channel], Channel, DMAC_INTPEND_TCMPL | Channel);
+		}
+	}
+}
+#endif
+
+/* TCC0 overflow, buffered pattern and period take effect then the interrupt or DMAC writes
+   the buffers for the following period.  NFRQ period is PER + 1 counts of the 1MHz clock */
+static void Sim_Overflow(void)
+{
+	TCC0->PATT.reg = TCC0->PATTBUF.reg;
+	TCC0->PER.reg = TCC0->PERBUF.reg;
+	const uint32_t Period = TCC0->PER.reg + 1;
+
+	/* Overcurrent comparator holds fault whilst short persists, outputs stay blanked until
+	   fault is cleared.  Track isn't driven until first pattern takes effect */
+	if (Sim_Short)
+		TCC0->STATUS.reg.Value |= TCC_STATUS_FAULT0;
+	if (TCC0->STATUS.reg & TCC_STATUS_FAULT0)
+		Sim_DecoderBlank(Period, Sim_Time);
+	else if (TCC0->PATT.reg & (TCC_PATT_PGE0 | TCC_PATT_PGE1))
+		Sim_DecoderLevel(TCC0->PATT.reg & TCC_PATT_PGV1, Period, Sim_Time);
+
+	Sim_AckUpdate();
+
+#if DCC_TX_DMA
+	Sim_DmaTrigger();
+#else
+	TCC0_Handler();
+#endif
+
+	Sim_Time += Period;
+}
+
+
+Time64_t Sim_Elapsed(void)
+{
+	return Sim_Time;
+}
+
+
+/* Move clock service on without running the engine, for benchmarks */
+void Sim_Advance(Time64_t Period)
+{
+	Sim_Time += Period;
+}
+
+/* Runs engine for Duration microseconds of virtual time, Epoch is the clock service time
+   at the start so wrap of the 32-bit time can be exercised */
+void Sim_Run(DCC_Mode_t Mode, Time64_t Duration, Time64_t Epoch, Sim_Hook_t Hook)
+{
+	Sim_Duration = Duration;
+	Sim_Epoch = Epoch;
+	Sim_Hook = Hook;
+
+	DMAC_Init();
+	DCC_Init(Mode);
+	PanicNull(Sim_DccTask);
+
+	if (!setjmp(Sim_Exit))
+	{
+		OS_TaskCurrent = &OS_TaskTable[DCC_TASK_ID];
+		Sim_DccTask(NULL);
+	}
+	OS_TaskCurrent = &OS_TaskTable[MAIN_TASK_ID];
+}
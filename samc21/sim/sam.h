@@ -0,0 +1,228 @@
+/*
+ * sam.h
+ *
+ * Created: 18/10/2026 13:48:10
+ *  Author: jonso
+ *
+ * Host stand-in for the device header, only the registers and bit definitions used by the
+ * DCC engine are provided.  Peripherals are plain structures in host memory, the simulator
+ * gives them behaviour where the engine depends on it (TCC0 overflow, DMAC beats).
+ */
+
+
+#ifndef SIM_SAM_H_
+#define SIM_SAM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __I		volatile const
+#define __O		volatile
+#define __IO	volatile
+
+/* Interrupt handlers are ordinary functions called by the simulator */
+#define __interrupt__	used
+
+typedef int IRQn_Type;
+
+enum
+{
+	DMAC_IRQn = 7,
+	TCC0_IRQn = 17,
+	TC0_IRQn = 20,
+	AC_IRQn = 25,
+};
+
+#define __NVIC_PRIO_BITS	(2)
+
+static inline void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+static inline uint32_t NVIC_GetPriority(IRQn_Type) { return 0; }
+static inline void NVIC_EnableIRQ(IRQn_Type) {}
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+static inline uint32_t __get_IPSR(void) { return 0; }
+static inline void __DMB(void) {}
+
+typedef struct { __IO uint32_t reg; } Sim_Reg32_t;
+typedef struct { __IO uint16_t reg; } Sim_Reg16_t;
+typedef struct { __IO uint8_t reg; } Sim_Reg8_t;
+
+/* Status bits are cleared by writing one, as they are on the device */
+#ifdef __cplusplus
+struct Sim_W1C_t
+{
+	uint32_t Value;
+	Sim_W1C_t &operator=(uint32_t Clear) { Value &= ~Clear; return *this; }
+	operator uint32_t() const { return Value; }
+};
+#else
+typedef uint32_t Sim_W1C_t;
+#endif
+
+
+/* PORT */
+typedef union { struct { uint8_t PMUXEN:1, INEN:1, PULLEN:1, :3, DRVSTR:1, :1; } bit; __IO uint8_t reg; } PORT_PINCFG_Type;
+typedef union { struct { uint8_t PMUXE:4, PMUXO:4; } bit; __IO uint8_t reg; } PORT_PMUX_Type;
+typedef union { struct { uint32_t SAMPLING:32; } bit; __IO uint32_t reg; } PORT_CTRL_Type;
+
+typedef struct
+{
+	Sim_Reg32_t DIR, DIRCLR, DIRSET, DIRTGL, OUT, OUTCLR, OUTSET, OUTTGL, IN;
+	PORT_CTRL_Type CTRL;
+	PORT_PMUX_Type PMUX[16];
+	PORT_PINCFG_Type PINCFG[32];
+} PortGroup;
+
+typedef struct { PortGroup Group[2]; } Port;
+extern Port *PORT;
+
+#define PIN_PA08		(8)
+#define PIN_PA09		(9)
+#define PIN_PA20		(20)
+#define PIN_PB05		(37)
+#define PIN_PB09		(41)
+
+
+/* MCLK */
+typedef struct { Sim_Reg32_t AHBMASK, APBAMASK, APBBMASK, APBCMASK; } Mclk;
+extern Mclk *MCLK;
+
+#define MCLK_AHBMASK_DMAC		(1 << 8)
+#define MCLK_APBCMASK_TCC0		(1 << 9)
+#define MCLK_APBCMASK_DAC		(1 << 23)
+
+#define TCC0_GCLK_ID			(28)
+
+
+/* TCC, pattern and period buffers are copied to PATT and PER on overflow */
+typedef struct
+{
+	Sim_Reg32_t CTRLA, CTRLBSET, SYNCBUSY, FCTRLA, FCTRLB, DRVCTRL, EVCTRL, INTENCLR, INTENSET, INTFLAG;
+	struct { Sim_W1C_t reg; } STATUS;
+	Sim_Reg32_t COUNT;
+	Sim_Reg16_t PATT;
+	Sim_Reg32_t WAVE, PER, CC[4];
+	Sim_Reg16_t PATTBUF;
+	Sim_Reg32_t PERBUF, CCBUF[4];
+} Tcc;
+extern Tcc *TCC0;
+
+#define TCC_CTRLA_ENABLE		(1 << 1)
+#define TCC_WAVE_WAVEGEN_NFRQ	(0)
+#define TCC_INTENSET_OVF		(1 << 0)
+#define TCC_INTFLAG_OVF			(1 << 0)
+#define TCC_SYNCBUSY_PER		(1 << 7)
+#define TCC_SYNCBUSY_PATT		(1 << 16)
+#define TCC_STATUS_FAULT0		(1 << 14)
+#define TCC_EVCTRL_EVACT0_FAULT	(7)
+#define TCC_EVCTRL_TCEI0		(1 << 14)
+#define TCC_DRVCTRL_NRE0		(1 << 0)
+#define TCC_DRVCTRL_NRE1		(1 << 1)
+#define TCC_PATT_PGE0			(1 << 0)
+#define TCC_PATT_PGE1			(1 << 1)
+#define TCC_PATT_PGV0			(1 << 8)
+#define TCC_PATT_PGV1			(1 << 9)
+
+
+/* TC, acknowledgment pulse capture */
+typedef union { struct { uint32_t SWRST:1, ENABLE:1, :2, CTRLB:1, STATUS:1, COUNT:1, PER:1, CC0:1, CC1:1, :22; } bit; __IO uint32_t reg; } TC_SYNCBUSY_Type;
+
+typedef struct
+{
+	Sim_Reg32_t CTRLA, CTRLBCLR, CTRLBSET, EVCTRL, INTENCLR, INTENSET, INTFLAG, WAVE;
+	TC_SYNCBUSY_Type SYNCBUSY;
+	Sim_Reg16_t COUNT;
+	Sim_Reg16_t CC[2];
+} TcCount16;
+
+typedef union { TcCount16 COUNT16; } Tc;
+extern Tc *TC4;
+
+#define TC_INTFLAG_OVF				(1 << 0)
+#define TC_INTFLAG_MC1				(1 << 5)
+#define TC_INTENSET_MC1				(1 << 5)
+#define TC_INTENCLR_MC1				(1 << 5)
+#define TC_CTRLBSET_CMD_RETRIGGER	(1 << 5)
+#define TC_CTRLBSET_CMD_READSYNC	(4 << 5)
+#define TC_SYNCBUSY_CTRLB			(1 << 2)
+#define TC_SYNCBUSY_COUNT			(1 << 4)
+
+
+/* AC */
+typedef union { struct { uint32_t ENABLE:1, :31; } bit; __IO uint32_t reg; } AC_COMPCTRL_Type;
+typedef union { struct { uint8_t STATE0:1, STATE1:1, STATE2:1, STATE3:1, :4; } bit; __IO uint8_t reg; } AC_STATUSA_Type;
+
+typedef struct
+{
+	Sim_Reg8_t CTRLA, CTRLB;
+	Sim_Reg16_t EVCTRL;
+	Sim_Reg8_t INTENCLR, INTENSET, INTFLAG;
+	AC_STATUSA_Type STATUSA;
+	Sim_Reg8_t SCALER[4];
+	AC_COMPCTRL_Type COMPCTRL[4];
+} Ac;
+extern Ac *AC;
+
+
+/* DMAC, channel registers are shared and selected by CHID */
+typedef union { struct { uint16_t VALID:1, EVOSEL:2, BLOCKACT:2, :3, BEATSIZE:2, SRCINC:1, DSTINC:1, STEPSEL:1, STEPSIZE:3; } bit; uint16_t reg; } DMAC_BTCTRL_Type;
+typedef union { uint16_t reg; } DMAC_BTCNT_Type;
+typedef union { uint32_t reg; } DMAC_SRCADDR_Type;
+typedef union { uint32_t reg; } DMAC_DSTADDR_Type;
+typedef union { uint32_t reg; } DMAC_DESCADDR_Type;
+typedef union { struct { uint32_t LVLEX0:1, LVLEX1:1, LVLEX2:1, LVLEX3:1, :4, ID:5, :2, ABUSY:1, BTCNT:16; } bit; uint32_t reg; } DMAC_ACTIVE_Type;
+typedef union { struct { uint32_t SWRST:1, DMAENABLE:1, CRCENABLE:1, :5, LVLEN0:1, LVLEN1:1, LVLEN2:1, LVLEN3:1, :20; } bit; __IO uint32_t reg; } DMAC_CTRL_Type;
+
+typedef struct
+{
+	DMAC_CTRL_Type CTRL;
+	Sim_Reg32_t INTPEND, BASEADDR, WRBADDR;
+	__IO DMAC_ACTIVE_Type ACTIVE;
+	Sim_Reg8_t CHID;
+	Sim_Reg8_t CHCTRLA;
+	Sim_Reg32_t CHCTRLB;
+	Sim_Reg8_t CHINTENCLR, CHINTENSET, CHINTFLAG, CHSTATUS;
+} Dmac;
+extern Dmac *DMAC;
+
+#define DMAC_CTRL_DMAENABLE			(1 << 1)
+#define DMAC_CTRL_LVLEN(Value)		((Value) << 8)
+#define DMAC_BTCTRL_VALID			(1 << 0)
+#define DMAC_BTCTRL_BLOCKACT_NOACT	(0 << 3)
+#define DMAC_BTCTRL_BLOCKACT_INT	(1 << 3)
+#define DMAC_BTCTRL_BEATSIZE_Msk	(3 << 8)
+#define DMAC_BTCTRL_BEATSIZE_BYTE	(0 << 8)
+#define DMAC_BTCTRL_BEATSIZE_HWORD	(1 << 8)
+#define DMAC_BTCTRL_BEATSIZE_WORD	(2 << 8)
+#define DMAC_BTCTRL_SRCINC			(1 << 10)
+#define DMAC_BTCTRL_DSTINC			(1 << 11)
+#define DMAC_CHCTRLA_SWRST			(1 << 0)
+#define DMAC_CHCTRLA_ENABLE			(1 << 1)
+#define DMAC_CHCTRLB_LVL(Value)		((Value) << 5)
+#define DMAC_CHCTRLB_TRIGSRC(Value)	((Value) << 8)
+#define DMAC_CHCTRLB_TRIGACT_BEAT	(2 << 22)
+#define DMAC_CHINTENSET_TERR		(1 << 0)
+#define DMAC_CHINTENSET_TCMPL		(1 << 1)
+#define DMAC_CHINTFLAG_TERR			(1 << 0)
+#define DMAC_CHINTFLAG_TCMPL		(1 << 1)
+#define DMAC_INTPEND_ID_Pos			(0)
+#define DMAC_INTPEND_ID_Msk			(0xF << DMAC_INTPEND_ID_Pos)
+#define DMAC_INTPEND_TERR			(1 << 8)
+#define DMAC_INTPEND_TCMPL			(1 << 9)
+#define DMAC_INTPEND_SUSP			(1 << 10)
+
+#define TCC0_DMAC_ID_OVF			(0x22)
+
+
+/* Debug UART isn't used, only its type is needed */
+typedef struct { Sim_Reg32_t CTRLA; } SercomUsart;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIM_SAM_H_ */
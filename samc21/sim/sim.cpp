@@ -0,0 +1,467 @@
+/*
+ * sim.cpp
+ *
+ * Created: 18/10/2026 13:40:15
+ *  Author: jonso
+ *
+ * Simulator scenarios.  Each run drives the engine through its public interface, decodes
+ * the track waveform and reports scheduler throughput, command latency and track
+ * utilisation.  Exit status is non-zero if the waveform broke any timing rule, so runs can
+ * be used as regression checks.
+ *
+ *   dcc_sim [-s load|estop|service|fault] [-n locos] [-t seconds] [-i interval ms] [-e epoch] [-p] [-v]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+#include "sim.h"
+
+#define SIM_MS(Ms)	((Time64_t)(Ms) * 1000)
+
+/* Throttles send commands to a new loco every millisecond at the start of a run */
+#define SIM_START_TIME		SIM_MS(1)
+#define SIM_START_INTERVAL	SIM_MS(1)
+#define SIM_SETTLE_TIME		SIM_MS(500)
+
+/* Command that hasn't reached the track by then is counted as missed */
+#define SIM_LATENCY_TIMEOUT	SIM_MS(2000)
+
+typedef enum
+{
+	SIM_SCENARIO_LOAD,
+	SIM_SCENARIO_ESTOP,
+	SIM_SCENARIO_SERVICE,
+	SIM_SCENARIO_FAULT,
+} Sim_Scenario_t;
+
+typedef struct
+{
+	uint16_t Address;
+	uint8_t Speed;			// Speed byte expected on track for pending command
+	bool Pending;
+	bool Seen;
+	Time64_t Issued;
+	Time64_t LastPacket;
+	Time64_t GapMax;
+	Time64_t GapTotal;
+	uint32_t Gaps;
+} Sim_Loco_t;
+
+static Sim_Scenario_t Sim_Scenario = SIM_SCENARIO_LOAD;
+static uint32_t Sim_NumLocos = 100;
+static Time64_t Sim_Duration = SIM_MS(10000);
+static Time64_t Sim_Interval = SIM_MS(20);
+static Time64_t Sim_Epoch;
+static bool Sim_PrintPackets;
+
+static std::vector<Sim_Loco_t> Sim_Locos;
+static std::vector<uint16_t> Sim_LocoIndex;
+static std::vector<uint32_t> Sim_Latency;
+static uint32_t Sim_Missed;
+static uint32_t Sim_Rng = 1;
+
+/* Packets decoded from track by class */
+static uint32_t Sim_SpeedPackets;
+static uint32_t Sim_FunctionPackets;
+static uint32_t Sim_IdlePackets;
+static uint32_t Sim_OtherPackets;
+static Time64_t Sim_BusyTime;
+
+/* Start of steady state, after all locos have been started */
+static Time64_t Sim_SteadyTime;
+static Time64_t Sim_NextTime;
+static uint32_t Sim_Started;
+
+static Time64_t Sim_EStopTime;
+static Time64_t Sim_EStopSeen;
+static Time64_t Sim_TrackBackTime;
+
+/* Virtual decoder on programming track */
+static uint8_t Sim_CvMemory[1024];
+static DCC_CvReadBatch_t Sim_Batch;
+static int16_t Sim_BatchValues[256];
+static Time64_t Sim_BatchTime;
+
+
+static uint32_t Sim_Random(uint32_t Range)
+{
+	Sim_Rng = Sim_Rng * 1103515245 + 12345;
+	return (Sim_Rng >> 16) % Range;
+}
+
+static uint8_t Sim_SpeedByte(uint8_t Speed, bool Forward)
+{
+	return (Forward ? 0x80 : 0x00) | (Speed ? Speed + 1 : 0);
+}
+
+
+static void Sim_LoadHook(Time64_t Now)
+{
+	if (Now < Sim_NextTime)
+		return;
+
+	if (Sim_Started < Sim_NumLocos)
+	{
+		/* Start next loco with a speed and F0 on */
+		Sim_Loco_t *Loco = &Sim_Locos[Sim_Started++];
+		const uint8_t Speed = 10 + Sim_Started % 100;
+		DCC_SetLocomotiveSpeed(Loco->Address, Speed, 1);
+		DCC_SetLocomotiveFunctions(Loco->Address, 0x10, 0);
+		Sim_NextTime = Now + SIM_START_INTERVAL;
+		if (Sim_Started == Sim_NumLocos)
+			Sim_NextTime = Sim_SteadyTime = Now + SIM_SETTLE_TIME;
+		return;
+	}
+
+	/* Steady state, change speed of a random loco that has no command pending */
+	Sim_NextTime = Now + Sim_Interval;
+	for (uint32_t Try = 0; Try < 8; Try++)
+	{
+		Sim_Loco_t *Loco = &Sim_Locos[Sim_Random(Sim_NumLocos)];
+		if (Loco->Pending)
+			continue;
+
+		const uint8_t Speed = 1 + Sim_Random(125);
+		DCC_SetLocomotiveSpeed(Loco->Address, Speed, 1);
+		Loco->Speed = Sim_SpeedByte(Speed, true);
+		Loco->Issued = Now;
+		Loco->Pending = true;
+		break;
+	}
+
+	/* Commands that never made it to the track */
+	for (Sim_Loco_t &Loco : Sim_Locos)
+	{
+		if (Loco.Pending && (Now - Loco.Issued > SIM_LATENCY_TIMEOUT))
+		{
+			Loco.Pending = false;
+			Sim_Missed += 1;
+		}
+	}
+}
+
+static void Sim_EStopHook(Time64_t Now)
+{
+	Sim_LoadHook(Now);
+	if (!Sim_EStopTime && Sim_SteadyTime && (Now >= Sim_SteadyTime + SIM_MS(1000)))
+	{
+		DCC_EmergencyStop();
+		Sim_EStopTime = Now;
+	}
+}
+
+static void Sim_FaultHook(Time64_t Now)
+{
+	Sim_LoadHook(Now);
+
+	/* Short for one second once steady */
+	const bool Short = Sim_SteadyTime && (Now >= Sim_SteadyTime) && (Now < Sim_SteadyTime + SIM_MS(1000));
+	Sim_SetShort(Short);
+}
+
+static void Sim_ServiceHook(Time64_t Now)
+{
+	if (!Sim_Batch.Count && (Now >= SIM_START_TIME))
+	{
+		Sim_Batch.FirstCv = 1;
+		Sim_Batch.Count = Sim_NumLocos;
+		Sim_Batch.Values = Sim_BatchValues;
+		DCC_CvReadBatch(&Sim_Batch, 0);
+	}
+	if (!Sim_BatchTime && Sim_Batch.Complete)
+		Sim_BatchTime = Now;
+}
+
+
+/* Service mode direct packets, acknowledge verify byte and verify bit that match */
+static void Sim_ServicePacket(const Sim_Packet_t *Packet)
+{
+	if ((Packet->Size != 4) || ((Packet->Data[0] & 0xF0) != 0x70))
+		return;
+
+	const uint16_t Cv = ((Packet->Data[0] & 0x03) << 8) | Packet->Data[1];
+	const uint8_t Operation = (Packet->Data[0] >> 2) & 0x03;
+	const uint8_t Value = Packet->Data[2];
+	if (Operation == 0x01)
+	{
+		if (Sim_CvMemory[Cv] == Value)
+			Sim_Acknowledge();
+	}
+	else if (Operation == 0x03)
+	{
+		Sim_CvMemory[Cv] = Value;
+		Sim_Acknowledge();
+	}
+	else if ((Operation == 0x02) && ((Value & 0xE0) == 0xE0))
+	{
+		const uint8_t Bit = Value & 0x07;
+		const bool BitValue = Value & 0x08;
+		const bool Write = Value & 0x10;
+		if (Write)
+		{
+			Sim_CvMemory[Cv] = (Sim_CvMemory[Cv] & ~(1 << Bit)) | (BitValue << Bit);
+			Sim_Acknowledge();
+		}
+		else if (((Sim_CvMemory[Cv] >> Bit) & 1) == BitValue)
+			Sim_Acknowledge();
+	}
+}
+
+static void Sim_PrintPacket(const Sim_Packet_t *Packet)
+{
+	printf("%10llu %2u:", (unsigned long long)Packet->End, Packet->Preamble);
+	for (uint8_t Index = 0; Index < Packet->Size; Index++)
+		printf(" %02X", Packet->Data[Index]);
+	printf("\n");
+}
+
+static void Sim_Packet(const Sim_Packet_t *Packet)
+{
+	if (Sim_PrintPackets)
+		Sim_PrintPacket(Packet);
+
+	if (Sim_Scenario == SIM_SCENARIO_SERVICE)
+	{
+		Sim_ServicePacket(Packet);
+		return;
+	}
+
+	if (Packet->Data[0] == 0xFF)
+	{
+		Sim_IdlePackets += 1;
+		return;
+	}
+	Sim_BusyTime += Packet->End - Packet->Start;
+
+	if ((Packet->Data[0] == 0x00) && (Packet->Data[1] == 0x51) && Sim_EStopTime && !Sim_EStopSeen)
+		Sim_EStopSeen = Packet->End;
+	if (Sim_SteadyTime && Sim_Elapsed() >= Sim_SteadyTime + SIM_MS(1000) && !Sim_TrackBackTime && Sim_GetTrackFaultCount())
+		Sim_TrackBackTime = Packet->End;
+
+	const uint16_t Address = Sim_PacketAddress(Packet);
+	if (!Address || (Sim_LocoIndex[Address] == 0))
+	{
+		Sim_OtherPackets += 1;
+		return;
+	}
+
+	Sim_Loco_t *Loco = &Sim_Locos[Sim_LocoIndex[Address] - 1];
+	const uint8_t Instruction = (Address > 127) ? 2 : 1;
+	const uint8_t Command = Packet->Data[Instruction];
+	if ((Command == 0x3F) || ((Command & 0xC0) == 0x40))
+	{
+		Sim_SpeedPackets += 1;
+		if (Loco->Pending && (Command == 0x3F) && (Packet->Data[Instruction + 1] == Loco->Speed))
+		{
+			Sim_Latency.push_back(Packet->End - Loco->Issued);
+			Loco->Pending = false;
+		}
+	}
+	else if ((Command & 0xE0) == 0x80)
+		Sim_FunctionPackets += 1;
+	else
+		Sim_OtherPackets += 1;
+
+	/* Refresh interval once all locos are running */
+	if (Sim_SteadyTime && (Packet->Start >= Sim_SteadyTime) && Loco->LastPacket >= Sim_SteadyTime)
+	{
+		const Time64_t Gap = Packet->End - Loco->LastPacket;
+		Loco->GapTotal += Gap;
+		Loco->Gaps += 1;
+		if (Gap > Loco->GapMax)
+			Loco->GapMax = Gap;
+	}
+	Loco->LastPacket = Packet->End;
+	Loco->Seen = true;
+}
+
+
+static void Sim_ReportLoad(void)
+{
+	const double Seconds = Sim_Elapsed() / 1e6;
+	const uint32_t Packets = Sim_SpeedPackets + Sim_FunctionPackets + Sim_IdlePackets + Sim_OtherPackets;
+
+	uint32_t Seen = 0, Refreshed = 0;
+	Time64_t GapMax = 0;
+	double GapMean = 0;
+	for (const Sim_Loco_t &Loco : Sim_Locos)
+	{
+		Seen += Loco.Seen;
+		if (Loco.Gaps)
+		{
+			Refreshed += 1;
+			GapMean += (double)Loco.GapTotal / Loco.Gaps;
+			if (Loco.GapMax > GapMax)
+				GapMax = Loco.GapMax;
+		}
+	}
+	if (Refreshed)
+		GapMean /= Refreshed;
+
+	printf("locos: %u started, %u on track\n", Sim_NumLocos, Seen);
+	printf("packets: %u, %.1f/s (speed %u, function %u, idle %u, other %u)\n", Packets, Packets / Seconds,
+		   Sim_SpeedPackets, Sim_FunctionPackets, Sim_IdlePackets, Sim_OtherPackets);
+	printf("refresh: mean %.1f ms, max %.1f ms\n", GapMean / 1000, GapMax / 1000.0);
+	printf("busy: %.1f%% of track time in non-idle packets\n", 100.0 * Sim_BusyTime / Sim_Elapsed());
+
+	std::sort(Sim_Latency.begin(), Sim_Latency.end());
+	if (!Sim_Latency.empty())
+	{
+		const size_t Count = Sim_Latency.size();
+		double Total = 0;
+		for (uint32_t Latency : Sim_Latency)
+			Total += Latency;
+		printf("latency: %zu commands, mean %.2f ms, p50 %.2f ms, p95 %.2f ms, max %.2f ms, missed %u\n", Count,
+			   Total / Count / 1000, Sim_Latency[Count / 2] / 1000.0, Sim_Latency[Count * 95 / 100] / 1000.0,
+			   Sim_Latency[Count - 1] / 1000.0, Sim_Missed);
+	}
+	else
+		printf("latency: no commands, missed %u\n", Sim_Missed);
+
+	const DCC_Stats_t *Stats = DCC_GetStats();
+	printf("engine: utilisation %u%%, real %.2f s, idle %.2f s, superseded %u, send overflows %u, queue high water %u\n",
+		   DCC_GetUtilisation(), Stats->RealTime / 1e6, Stats->IdleTime / 1e6, Stats->Superseded,
+		   Stats->SendOverflows, Stats->QueueHighWater);
+	printf("addresses: refused %u\n", Stats->Refused);
+	printf("lag:");
+	for (uint8_t Bucket = 0; Bucket < DCC_LAG_BUCKETS; Bucket++)
+		printf(" %u", Stats->Lag[Bucket]);
+	printf("\n");
+}
+
+static bool Sim_ReportWaveform(void)
+{
+	const Sim_DecoderStats_t *Stats = Sim_DecoderGetStats();
+	printf("waveform: one %u-%u us, zero %u-%u us, gaps %u\n", Stats->OneMin, Stats->OneMax,
+		   Stats->ZeroMin, Stats->ZeroMax, Stats->Gaps);
+	printf("errors: checksum %u, preamble %u, timing %u, framing %u, hold-off %u\n", Stats->ChecksumErrors,
+		   Stats->PreambleErrors, Stats->TimingErrors, Stats->FramingErrors, Stats->HoldOffErrors);
+
+	return !Stats->ChecksumErrors && !Stats->PreambleErrors && !Stats->TimingErrors &&
+		   !Stats->FramingErrors && !Stats->HoldOffErrors;
+}
+
+
+static void Sim_Usage(const char *Name)
+{
+	fprintf(stderr, "usage: %s [-s load|estop|service|fault] [-n locos] [-t seconds] [-i interval ms] [-e epoch] [-p] [-v]\n", Name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int Option;
+	while ((Option = getopt(argc, argv, "s:n:t:i:e:pv")) != -1)
+	{
+		switch (Option)
+		{
+			case 's':
+				if (!strcmp(optarg, "load"))
+					Sim_Scenario = SIM_SCENARIO_LOAD;
+				else if (!strcmp(optarg, "estop"))
+					Sim_Scenario = SIM_SCENARIO_ESTOP;
+				else if (!strcmp(optarg, "service"))
+					Sim_Scenario = SIM_SCENARIO_SERVICE;
+				else if (!strcmp(optarg, "fault"))
+					Sim_Scenario = SIM_SCENARIO_FAULT;
+				else
+					Sim_Usage(argv[0]);
+				break;
+			case 'n': Sim_NumLocos = strtoul(optarg, NULL, 0); break;
+			case 't': Sim_Duration = (Time64_t)(strtod(optarg, NULL) * 1e6); break;
+			case 'i': Sim_Interval = SIM_MS(strtoul(optarg, NULL, 0)); break;
+			case 'e': Sim_Epoch = strtoull(optarg, NULL, 0); break;
+			case 'p': Sim_PrintPackets = true; break;
+			case 'v': Sim_Verbose = true; break;
+			default: Sim_Usage(argv[0]);
+		}
+	}
+
+	if (!Sim_NumLocos || (Sim_NumLocos > SIM_ADDRESS_MAX) ||
+		((Sim_Scenario == SIM_SCENARIO_SERVICE) && (Sim_NumLocos > 256)))
+		Sim_Usage(argv[0]);
+
+	/* Locos have addresses 1 upwards, above 127 they're long addresses */
+	Sim_LocoIndex.assign(SIM_ADDRESS_MAX + 1, 0);
+	Sim_Locos.resize(Sim_NumLocos);
+	for (uint32_t Index = 0; Index < Sim_NumLocos; Index++)
+	{
+		memset(&Sim_Locos[Index], 0, sizeof(Sim_Loco_t));
+		Sim_Locos[Index].Address = Index + 1;
+		Sim_LocoIndex[Index + 1] = Index + 1;
+	}
+	Sim_NextTime = SIM_START_TIME;
+
+	bool Pass = true;
+	switch (Sim_Scenario)
+	{
+		case SIM_SCENARIO_LOAD:
+			Sim_DecoderInit(Sim_Packet, true);
+			Sim_Run(DCC_MODE_NORMAL, Sim_Duration, Sim_Epoch, Sim_LoadHook);
+			Sim_ReportLoad();
+			break;
+
+		case SIM_SCENARIO_ESTOP:
+		{
+			Sim_DecoderInit(Sim_Packet, true);
+			Sim_Run(DCC_MODE_NORMAL, Sim_Duration, Sim_Epoch, Sim_EStopHook);
+			Sim_ReportLoad();
+			uint32_t Latency, LatencyMax;
+			DCC_GetEmergencyStopLatency(&Latency, &LatencyMax);
+			if (Sim_EStopSeen)
+				printf("estop: on track after %.2f ms, engine latency %u us\n", (Sim_EStopSeen - Sim_EStopTime) / 1000.0, Latency);
+			else
+				printf("estop: %s\n", Sim_EStopTime ? "not seen on track" : "not sent, run is too short");
+			Pass = Sim_EStopSeen;
+			break;
+		}
+
+		case SIM_SCENARIO_SERVICE:
+		{
+			for (uint16_t Cv = 0; Cv < sizeof(Sim_CvMemory); Cv++)
+				Sim_CvMemory[Cv] = (Cv * 37 + 5) & 0xFF;
+
+			/* Hold-off doesn't apply, service mode packets have no address */
+			Sim_DecoderInit(Sim_Packet, false);
+			Sim_Run(DCC_MODE_SERVICE, Sim_Duration, Sim_Epoch, Sim_ServiceHook);
+
+			uint32_t Wrong = 0;
+			for (uint16_t Index = 0; Index < Sim_Batch.Done; Index++)
+				Wrong += (Sim_BatchValues[Index] != Sim_CvMemory[Sim_Batch.FirstCv + Index - 1]);
+			if (Sim_BatchTime)
+				printf("service: %u CVs read in %.2f s, %.1f ms per CV, %u wrong\n", Sim_Batch.Done,
+					   (Sim_BatchTime - SIM_START_TIME) / 1e6, (Sim_BatchTime - SIM_START_TIME) / 1000.0 / Sim_Batch.Done, Wrong);
+			else
+				printf("service: %u of %u CVs read, %u wrong, run is too short\n", Sim_Batch.Done, Sim_Batch.Count, Wrong);
+			Pass = Sim_BatchTime && !Wrong;
+			break;
+		}
+
+		case SIM_SCENARIO_FAULT:
+		{
+			Sim_DecoderInit(Sim_Packet, true);
+			Sim_Run(DCC_MODE_NORMAL, Sim_Duration, Sim_Epoch, Sim_FaultHook);
+			Sim_ReportLoad();
+			uint32_t Faults;
+			const bool Fault = DCC_GetTrackFault(&Faults);
+			printf("fault: %u trips, outputs blanked %.2f s, track %s", Faults,
+				   Sim_DecoderGetStats()->BlankTime / 1e6, Fault ? "off" : "on");
+			if (Sim_TrackBackTime)
+				printf(", packets again %.2f s after short removed\n", (Sim_TrackBackTime - Sim_SteadyTime - SIM_MS(1000)) / 1e6);
+			else
+				printf(", no packets after short removed\n");
+			Pass = Faults && !Fault && Sim_TrackBackTime;
+			break;
+		}
+	}
+
+	if (!Sim_ReportWaveform())
+		Pass = false;
+	printf("%s\n", Pass ? "PASS" : "FAIL");
+	return Pass ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * sim.h
+ *
+ * Created: 18/10/2026 13:41:02
+ *  Author: jonso
+ *
+ * Host simulator for the DCC engine.  dcc.cpp, dcc_tx.cpp and dcc_packet.cpp are built
+ * unchanged against a stand-in device header, TCC0 is stepped one overflow at a time in
+ * virtual microseconds and each half-bit it outputs is passed to a decoder model that
+ * parses the waveform back into packets and checks its timing.
+ */
+
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rtime.h"
+#include "dcc.h"
+
+/* Longest packet that's decoded, service mode and long address packets are at most 6 bytes */
+#define SIM_PACKET_MAX		(8)
+
+/* Highest long address, hold-off is tracked per multi-function decoder address */
+#define SIM_ADDRESS_MAX		(10239)
+
+/* Transmitter half-bit limits from NMRA S-9.1 */
+#define SIM_ONE_MIN			(55)
+#define SIM_ONE_MAX			(61)
+#define SIM_ONE_SKEW_MAX	(3)
+#define SIM_ZERO_MIN		(95)
+#define SIM_ZERO_MAX		(9900)
+
+/* Preamble a command station must send and time between packets to the same decoder, NMRA S-9.2 */
+#define SIM_PREAMBLE_MIN	(14)
+#define SIM_HOLDOFF_MIN		(5000)
+
+/* Service mode acknowledgment is a 6ms increase in current */
+#define SIM_ACK_WIDTH		(6000)
+
+typedef struct
+{
+	Time64_t Start;			// Start of start bit
+	Time64_t End;			// End of end bit
+	uint8_t Preamble;		// One bits before start bit
+	uint8_t Size;
+	uint8_t Data[SIM_PACKET_MAX];
+} Sim_Packet_t;
+
+typedef struct
+{
+	uint32_t Packets;
+	uint32_t ChecksumErrors;
+	uint32_t PreambleErrors;	// Preamble shorter than SIM_PREAMBLE_MIN
+	uint32_t TimingErrors;		// Half-bit outside transmitter limits, or halves of a one differ
+	uint32_t FramingErrors;		// Half-bit that's neither a one nor a zero, or mismatched halves
+	uint32_t HoldOffErrors;		// Packets to same decoder, or after a broadcast, closer than SIM_HOLDOFF_MIN
+	uint32_t Gaps;				// Track held low after end bit
+	uint16_t OneMin, OneMax;
+	uint16_t ZeroMin, ZeroMax;
+	Time64_t BlankTime;			// Time outputs were blanked by a fault
+} Sim_DecoderStats_t;
+
+/* Called once per half-bit from the main task with elapsed virtual time in microseconds */
+typedef void (*Sim_Hook_t)(Time64_t Elapsed);
+
+/* Called for each packet decoded from the track */
+typedef void (*Sim_PacketHandler_t)(const Sim_Packet_t *Packet);
+
+extern bool Sim_Verbose;
+
+void Sim_Run(DCC_Mode_t Mode, Time64_t Duration, Time64_t Epoch, Sim_Hook_t Hook);
+Time64_t Sim_Elapsed(void);
+void Sim_Advance(Time64_t Period);
+void Sim_SetShort(bool Short);
+void Sim_Acknowledge(void);
+uint32_t Sim_GetTrackFaultCount(void);
+
+void Sim_DecoderInit(Sim_PacketHandler_t Handler, bool CheckHoldOff);
+void Sim_DecoderLevel(bool High, uint32_t Period, Time64_t Time);
+void Sim_DecoderBlank(uint32_t Period, Time64_t Time);
+const Sim_DecoderStats_t *Sim_DecoderGetStats(void);
+uint16_t Sim_PacketAddress(const Sim_Packet_t *Packet);
+
+#endif /* SIM_H_ */